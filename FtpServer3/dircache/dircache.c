@@ -0,0 +1,320 @@
+/*
+ *
+ *  Directory cache on STM32-E407 with ChibiOs
+ *
+ *  Copyright (c) 2015 by Jean-Michel Gallego
+ *
+ *  Please read file ReadMe.txt for instructions
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Cache of directory entries, shared by all threads
+//
+// A directory is read entirely the first time one of its entries is looked
+//   for. Next lookups in that directory, and next listings of it, are done
+//   without reading the SD card.
+// dircacheInvalidate() must be called each time a file or directory is
+//   created, deleted, renamed, written or has its time modified.
+
+#include "dircache.h"
+
+#include "string.h"
+#include "ctype.h"
+
+#define DC_FREE                  0
+#define DC_READY                 1
+#define DC_LARGE                 2             // too large to be cached
+#define DC_STALE                 3             // invalidated while listed
+
+// Entries are stored one after the other in data[] of the directory:
+//   fsize (4 bytes), fdate (2), ftime (2), fattrib (1),
+//   length of short name (1), length of long name (1), short name, long name
+#define DC_HEAD_SIZE             11
+
+struct dircache_dir
+{
+  char     path[ DIRCACHE_PATH_SIZE ];
+  uint8_t  data[ DIRCACHE_DIR_SIZE ];
+  uint16_t len;                   // number of bytes used in data[]
+  uint8_t  state;
+  uint8_t  refs;                  // number of listings in progress
+  uint32_t used;                  // value of dcCounter when last used
+};
+
+static struct dircache_dir dcd[ DIRCACHE_DIRS ] DIRCACHE_SECTION;
+static uint32_t dcCounter;
+static mutex_t  dcMtx;
+
+// Used to read directories, protected by dcMtx
+static DIR      dcDir;
+static FILINFO  dcInfo;
+static char     dcLfn[ _MAX_LFN + 1 ];
+
+struct dircache_stru dcs;
+
+// Must be called before any access to the file system
+//   (section .ram4 is not initialized at startup)
+
+void dircacheInit( void )
+{
+  uint8_t i;
+
+  for( i = 0; i < DIRCACHE_DIRS; i ++ )
+  {
+    dcd[ i ].state = DC_FREE;
+    dcd[ i ].refs = 0;
+  }
+  dcCounter = 0;
+  chMtxObjectInit( & dcMtx );
+  memset( & dcs, 0, sizeof( dcs ));
+}
+
+// Compare names, ignoring case of ASCII letters
+
+static bool nameEqual( const char * s1, const char * s2, uint16_t len )
+{
+  while( len -- > 0 )
+    if( toupper( (uint8_t) * s1 ++ ) != toupper( (uint8_t) * s2 ++ ))
+      return false;
+  return true;
+}
+
+
+// Read directory path in a free slot
+//   The least recently used directory not being listed is replaced
+
+static int8_t dcLoad( const char * path )
+{
+  int8_t   i, slot = -1;
+  uint8_t  ls, ll;
+  uint8_t * p;
+
+  if( strlen( path ) >= DIRCACHE_PATH_SIZE )
+    return -1;
+  for( i = 0; i < DIRCACHE_DIRS; i ++ )
+    if( dcd[ i ].refs == 0 &&
+        ( slot < 0 || dcd[ i ].state == DC_FREE ||
+          ( dcd[ slot ].state != DC_FREE && dcd[ i ].used < dcd[ slot ].used )))
+      slot = i;
+  if( slot < 0 )
+    return -1;
+  if( dcd[ slot ].state != DC_FREE )
+    dcs.evicts ++;
+  dcd[ slot ].state = DC_FREE;
+  if( f_opendir( & dcDir, path ) != FR_OK )
+    return -1;
+  dcs.loads ++;
+  strcpy( dcd[ slot ].path, path );
+  dcd[ slot ].len = 0;
+  dcd[ slot ].state = DC_READY;
+  dcInfo.lfname = dcLfn;
+  dcInfo.lfsize = sizeof( dcLfn );
+  while( f_readdir( & dcDir, & dcInfo ) == FR_OK && dcInfo.fname[ 0 ] != 0 )
+  {
+    ls = strlen( dcInfo.fname );
+    ll = strlen( dcLfn );
+    if( dcd[ slot ].len + DC_HEAD_SIZE + ls + ll > DIRCACHE_DIR_SIZE )
+    {
+      dcd[ slot ].state = DC_LARGE;
+      break;
+    }
+    p = dcd[ slot ].data + dcd[ slot ].len;
+    memcpy( p, & dcInfo.fsize, 4 );
+    memcpy( p + 4, & dcInfo.fdate, 2 );
+    memcpy( p + 6, & dcInfo.ftime, 2 );
+    p[ 8 ] = dcInfo.fattrib;
+    p[ 9 ] = ls;
+    p[ 10 ] = ll;
+    memcpy( p + DC_HEAD_SIZE, dcInfo.fname, ls );
+    memcpy( p + DC_HEAD_SIZE + ls, dcLfn, ll );
+    dcd[ slot ].len += DC_HEAD_SIZE + ls + ll;
+  }
+  f_closedir( & dcDir );
+  return slot;
+}
+
+// Return slot of directory path, reading it if necessary, or -1
+//   Count a hit if the directory was in cache, else a miss
+
+static int8_t dcFind( const char * path )
+{
+  int8_t i;
+
+  for( i = 0; i < DIRCACHE_DIRS; i ++ )
+    if(( dcd[ i ].state == DC_READY || dcd[ i ].state == DC_LARGE ) &&
+       strlen( dcd[ i ].path ) == strlen( path ) &&
+       nameEqual( dcd[ i ].path, path, strlen( path )))
+      break;
+  if( i == DIRCACHE_DIRS )
+  {
+    dcs.misses ++;
+    i = dcLoad( path );
+  }
+  else
+    dcs.hits ++;
+  if( i >= 0 )
+    dcd[ i ].used = ++ dcCounter;
+  return i;
+}
+
+// Copy entry at position pos of directory slot to pfi
+//
+// return position of next entry
+
+static uint16_t dcEntry( int8_t slot, uint16_t pos, FILINFO * pfi )
+{
+  uint8_t * p = dcd[ slot ].data + pos;
+  uint8_t   ls = p[ 9 ], ll = p[ 10 ];
+
+  memcpy( & pfi->fsize, p, 4 );
+  memcpy( & pfi->fdate, p + 4, 2 );
+  memcpy( & pfi->ftime, p + 6, 2 );
+  pfi->fattrib = p[ 8 ];
+  memcpy( pfi->fname, p + DC_HEAD_SIZE, ls );
+  pfi->fname[ ls ] = 0;
+  if( pfi->lfname != NULL && pfi->lfsize > 0 )
+  {
+    if( ll >= pfi->lfsize )
+      ll = 0;
+    memcpy( pfi->lfname, p + DC_HEAD_SIZE + ls, ll );
+    pfi->lfname[ ll ] = 0;
+  }
+  return pos + DC_HEAD_SIZE + ls + p[ 10 ];
+}
+
+// Same as f_stat()
+//
+// A name not found in a cached directory is looked for with f_stat() unless
+//   it is made of ASCII characters, as FatFs compares other characters
+//   according to the code page
+
+FRESULT dircacheStat( const char * path, FILINFO * pfi )
+{
+  char     dir[ DIRCACHE_PATH_SIZE ];
+  const char * name;
+  uint16_t ln, pos;
+  int8_t   slot;
+  uint8_t * p;
+  bool     ascii = true;
+
+  name = strrchr( path, '/' );
+  if( name == NULL || name[ 1 ] == 0 || name - path >= DIRCACHE_PATH_SIZE )
+    goto nocache;
+  ln = strlen( ++ name );
+  if( name[ ln - 1 ] == '.' || name[ ln - 1 ] == ' ' )
+    goto nocache;
+  for( pos = 0; pos < ln; pos ++ )
+    if( (uint8_t) name[ pos ] >= 0x80 )
+      ascii = false;
+  if( name - path == 1 )
+    strcpy( dir, "/" );
+  else
+  {
+    memcpy( dir, path, name - path - 1 );
+    dir[ name - path - 1 ] = 0;
+  }
+
+  chMtxLock( & dcMtx );
+  slot = dcFind( dir );
+  if( slot >= 0 && dcd[ slot ].state == DC_READY )
+  {
+    for( pos = 0; pos < dcd[ slot ].len; )
+    {
+      p = dcd[ slot ].data + pos;
+      if(( p[ 9 ] == ln && nameEqual( (char *) p + DC_HEAD_SIZE, name, ln )) ||
+         ( p[ 10 ] == ln && nameEqual( (char *) p + DC_HEAD_SIZE + p[ 9 ], name, ln )))
+      {
+        dcEntry( slot, pos, pfi );
+        chMtxUnlock( & dcMtx );
+        return FR_OK;
+      }
+      pos += DC_HEAD_SIZE + p[ 9 ] + p[ 10 ];
+    }
+    if( ascii )
+    {
+      chMtxUnlock( & dcMtx );
+      return FR_NO_FILE;
+    }
+  }
+  chMtxUnlock( & dcMtx );
+  return f_stat( path, pfi );
+
+  nocache:
+  dcs.misses ++;
+  return f_stat( path, pfi );
+}
+
+// Begin listing directory path from cache
+//
+// return slot to pass to dircacheRead() and dircacheClose(),
+//   or -1 if the directory must be read with f_readdir()
+
+int8_t dircacheOpen( const char * path )
+{
+  int8_t slot;
+
+  chMtxLock( & dcMtx );
+  slot = dcFind( path );
+  if( slot >= 0 && dcd[ slot ].state == DC_READY )
+    dcd[ slot ].refs ++;
+  else
+    slot = -1;
+  chMtxUnlock( & dcMtx );
+  return slot;
+}
+
+// Same as f_readdir(). *ppos must be 0 for the first entry
+//
+// return false after last entry
+
+bool dircacheRead( int8_t slot, uint16_t * ppos, FILINFO * pfi )
+{
+  // The slot is not modified while refs > 0
+  if( * ppos >= dcd[ slot ].len )
+    return false;
+  * ppos = dcEntry( slot, * ppos, pfi );
+  return true;
+}
+
+void dircacheClose( int8_t slot )
+{
+  chMtxLock( & dcMtx );
+  if( dcd[ slot ].refs > 0 )
+    dcd[ slot ].refs --;
+  if( dcd[ slot ].refs == 0 && dcd[ slot ].state == DC_STALE )
+    dcd[ slot ].state = DC_FREE;
+  chMtxUnlock( & dcMtx );
+}
+
+// Called when path is modified: remove all directories from cache
+//   Directories are cached under the path given by the sessions, and
+//   the same one may be reached by other paths (short name alias,
+//   "." or ".."), so only dropping them all is safe. With DIRCACHE_DIRS
+//   directories, this costs little more than finding those of path
+
+void dircacheInvalidate( const char * path )
+{
+  (void) path;
+
+  chMtxLock( & dcMtx );
+  for( int8_t i = 0; i < DIRCACHE_DIRS; i ++ )
+  {
+    if( dcd[ i ].state != DC_READY && dcd[ i ].state != DC_LARGE )
+      continue;
+    dcd[ i ].state = dcd[ i ].refs > 0 ? DC_STALE : DC_FREE;
+    dcs.invalidates ++;
+  }
+  chMtxUnlock( & dcMtx );
+}
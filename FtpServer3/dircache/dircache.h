@@ -0,0 +1,69 @@
+/*
+ *
+ *  Directory cache on STM32-E407 with ChibiOs
+ *
+ *  Copyright (c) 2015 by Jean-Michel Gallego
+ *
+ *  Please read file ReadMe.txt for instructions
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _DIRCACHE_H_
+#define _DIRCACHE_H_
+
+#include "ch.h"
+
+#include "ff.h"
+
+#include "console.h"
+
+// Number of directories kept in cache
+#define DIRCACHE_DIRS            4
+
+// Size of the entries of a directory (26 bytes for a file with a 8.3 name)
+//   Larger directories are not cached
+#define DIRCACHE_DIR_SIZE        4096
+
+#define DIRCACHE_PATH_SIZE       ( _MAX_LFN + 8 )
+
+// Section where entries are stored (CCM RAM)
+#define DIRCACHE_SECTION         __attribute__(( section( ".ram4" )))
+
+// Statistics of the cache
+struct dircache_stru
+{
+  uint32_t hits;                  // lookups in a directory found in cache
+  uint32_t misses;                // lookups needing to read the SD card
+  uint32_t loads;                 // directories read into cache
+  uint32_t evicts;                // directories removed to make room
+  uint32_t invalidates;           // directories removed after a modification
+};
+
+extern struct dircache_stru dcs;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  void    dircacheInit( void );
+  FRESULT dircacheStat( const char * path, FILINFO * pfi );
+  int8_t  dircacheOpen( const char * path );
+  bool    dircacheRead( int8_t slot, uint16_t * ppos, FILINFO * pfi );
+  void    dircacheClose( int8_t slot );
+  void    dircacheInvalidate( const char * path );
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _DIRCACHE_H_
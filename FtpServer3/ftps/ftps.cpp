@@ -20,15 +20,126 @@
 #include <string.h>
 
 #include <ftps/ftps.h>
+#include "lwip/tcp.h"
 
 // Stack area for the ftp server thread.
 THD_WORKING_AREA( wa_ftp_server, SERVER_THREAD_STACK_SIZE );
 
+// Stack area for the storage thread.
+THD_WORKING_AREA( wa_ftp_storage, FTP_STORAGE_THREAD_STACK_SIZE );
+
+// Signaled when a session submits a request to ftp_storage
+binary_semaphore_t ftp_storage_sem;
+
+// Number of pbufs sessions can still queue to ftp_storage
+semaphore_t ftp_stor_sem;
+struct ftp_sched_stru ftpss;
+
 //  Stack areas for the ftp threads.
-THD_WORKING_AREA( wa_ftp_conn[ FTP_NBR_CLIENTS ], FTP_THREAD_STACK_SIZE );
+THD_WORKING_AREA( wa_ftp_conn[ FTP_NBR_WORKERS ], FTP_THREAD_STACK_SIZE );
 
 //  array of parameters for each ftp thread
-struct server_stru ss[ FTP_NBR_CLIENTS ];
+struct server_stru ss[ FTP_NBR_WORKERS ];
+
+//  File buffers for each ftp thread
+uint32_t ftp_file_buf[ FTP_NBR_WORKERS ][ FTP_FILE_BUF_NBR ][ FTP_FILE_BUF_SIZE / 4 ];
+
+//  RAM used by each ftp thread
+const uint32_t ftp_worker_ram = sizeof( wa_ftp_conn[ 0 ] ) +
+                                sizeof( ftp_file_buf[ 0 ] ) + sizeof( ss[ 0 ] );
+
+//  Listening connection, and semaphore waking up ftp_server when
+//    a client connects or a session ends
+static struct netconn * ftpsrvconn;
+static binary_semaphore_t ftp_server_sem;
+
+//  Connections accepted by lwIP, not yet by ftp_server, and the time
+//    they were accepted
+#define FTP_ACCEPT_TS            8             // power of 2
+static volatile int16_t ftp_accept_avail;
+static systime_t ftp_accept_ts[ FTP_ACCEPT_TS ];
+static uint8_t ftp_ts_head, ftp_ts_tail;
+
+//  Clients waiting for a free slot
+struct pending_conn
+{
+  struct netconn * conn;
+  systime_t t;                    // time accepted by lwIP
+};
+
+static struct pending_conn ftp_pending[ FTP_PENDING_SIZE ];
+static uint8_t ftp_pend_tail, ftp_pend_nbr;
+
+//  Upper bounds of the bins of accept latencies, in ms
+static const uint16_t ftp_accept_bound[ FTP_ACCEPT_BINS - 1 ] =
+  { 1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000 };
+struct ftp_accept_stru ftpas;
+
+//  Passive data connections of sessions, and listening connections
+//    shared by them
+//    ftp_pasv_mtx protects the listening connections, used both by
+//    the sessions and by ftp_server
+struct pasv_listen
+{
+  struct netconn * conn;          // NULL if not open
+  uint16_t port;
+  int8_t   avail;                 // connections waiting for netconn_accept()
+  uint8_t  waiting;               // number of sessions waiting for one
+  systime_t tConnect;             // time the last client connected
+  systime_t tIdle;                // time waiting became 0
+};
+
+struct pasv_stru ftp_pasv[ FTP_NBR_CLIENTS ];
+struct ftp_pasv_stru ftpps;
+static struct pasv_listen ftp_lst[ FTP_PASV_LISTENERS ];
+static mutex_t ftp_pasv_mtx;
+
+//  Bandwidth shaping: rules giving the rate of sessions, and
+//    bucket shared by all of them, protected by ftp_rate_mtx
+static const struct rate_rule ftp_rate_rules[] = { FTP_RATE_RULES };
+static struct token_bucket ftp_rate_all;
+static mutex_t ftp_rate_mtx;
+uint16_t ftp_rate_global;
+struct ftp_rate_stru ftprs;
+
+#if FTP_EVENT_ENGINE
+//  Session engine
+#define SES_FREE                 0
+#define SES_IDLE                 1             // waiting for a command
+#define SES_QUEUED               2             // in ftp_ready_mb
+#define SES_BUSY                 3             // served by a worker
+
+static struct ftp_session ftp_ses[ FTP_NBR_CLIENTS ];
+
+// Mailbox of sessions having received bytes
+//   A session is queued only once, so it can't be full
+static msg_t ftp_ready_msg[ FTP_NBR_CLIENTS ];
+static mailbox_t ftp_ready_mb;
+#endif
+
+//  Hot file cache
+#define HOT_FREE                 0
+#define HOT_LOADING              1             // being read from SD card
+#define HOT_READY                2
+#define HOT_STALE                3             // invalidated while in use
+
+struct hot_file
+{
+  char     path[ FTP_CWD_SIZE ];
+  WORD     fdate;
+  WORD     ftime;
+  DWORD    fsize;
+  uint8_t  state;
+  uint8_t  refs;                  // number of sessions sending the file
+  uint32_t used;                  // value of hot_counter when last used
+};
+
+static struct hot_file hot[ FTP_HOT_FILE_NBR ];
+static uint32_t hot_buf[ FTP_HOT_FILE_NBR ][ FTP_HOT_FILE_SIZE / 4 ];
+static uint32_t hot_counter;
+static mutex_t hot_mtx;
+uint32_t ftp_hot_hits;
+uint32_t ftp_hot_loads;
 
 // =========================================================
 //
@@ -36,6 +147,8 @@ struct server_stru ss[ FTP_NBR_CLIENTS ];
 //
 // =========================================================
 
+#if ! FTP_EVENT_ENGINE
+
 THD_FUNCTION( ftp_conn, p )
 {
   struct server_stru * pss = (server_stru *) p;
@@ -54,8 +167,1053 @@ THD_FUNCTION( ftp_conn, p )
       ftpSrv.service( pss->num, pss->ftpconn );   // call the http function
       netconn_delete( pss->ftpconn );             // delete the connection.
       pss->ftpconn = NULL;
+      chBSemSignal( & ftp_server_sem );           // slot is free
+    }
+  }
+}
+
+#else
+
+// Queue a session to the workers
+//   Must be called with the system locked
+
+static void ses_post_i( struct ftp_session * pses )
+{
+  pses->state = SES_QUEUED;
+  chMBPostI( & ftp_ready_mb, (msg_t) pses );
+}
+
+THD_FUNCTION( ftp_conn, p )
+{
+  struct server_stru * pss = (server_stru *) p;
+  char tn[] = "ftp_conn_n";
+  FtpServer ftpSrv;
+  msg_t msg;
+
+  // names thread as ftp_conn_1, ftp_conn_2, ...
+  tn[ strlen( tn ) - 1 ] = pss->num + '1';
+  chRegSetThreadName( tn );
+
+  while( true )
+  {
+    // wait for a session having something to do
+    if( chMBFetch( & ftp_ready_mb, & msg, TIME_INFINITE ) != MSG_OK )
+      continue;
+    struct ftp_session * pses = (struct ftp_session *) msg;
+    chSysLock();
+    pses->state = SES_BUSY;
+    pses->again = false;
+    chSysUnlock();
+    if( ftpSrv.resume( pss->num, pses ))
+    {
+      // Bytes received while the session was served may hold a command
+      chSysLock();
+      if( pses->again )
+        ses_post_i( pses );
+      else
+        pses->state = SES_IDLE;
+      chSchRescheduleS();
+      chSysUnlock();
+    }
+    else
+    {
+      struct netconn * conn = pses->ctrlconn;
+      chSysLock();
+      pses->ctrlconn = NULL;
+      chSysUnlock();
+      netconn_delete( conn );
+      pses->state = SES_FREE;
+      chBSemSignal( & ftp_server_sem );
+    }
+  }
+}
+
+#endif // FTP_EVENT_ENGINE
+
+// =========================================================
+//
+//  Callback of control connections.
+//
+//  Called by lwIP thread. On the listening connection, count
+//    the connections waiting for netconn_accept() and wake up
+//    ftp_server.
+//  Called also when bytes are received by a session (or the
+//    connection is closed by the client). During a transfer, tell
+//    the worker to read them. With the session engine, queue the
+//    session to the workers, unless one of them is already serving it.
+//
+// =========================================================
+
+void ftp_ctrl_event( struct netconn * conn, enum netconn_evt evt, u16_t len )
+{
+  (void) len;
+
+  if( evt != NETCONN_EVT_RCVPLUS && evt != NETCONN_EVT_RCVMINUS )
+    return;
+  chSysLock();
+  if( conn == ftpsrvconn )
+  {
+    if( evt == NETCONN_EVT_RCVPLUS )
+    {
+      if( (uint8_t) ( ftp_ts_head - ftp_ts_tail ) < FTP_ACCEPT_TS )
+        ftp_accept_ts[ ftp_ts_head ++ % FTP_ACCEPT_TS ] = chVTGetSystemTimeX();
+      ftp_accept_avail ++;
+      chBSemSignalI( & ftp_server_sem );
     }
+    else
+      ftp_accept_avail --;
+  }
+  else if( evt == NETCONN_EVT_RCVPLUS )
+  {
+    // A command may have been received during a transfer
+    for( uint8_t i = 0; i < FTP_NBR_WORKERS; i ++ )
+      if( ss[ i ].ctrlconn == conn )
+      {
+        ss[ i ].ctrlRcv = true;
+        break;
+      }
+#if FTP_EVENT_ENGINE
+    for( uint8_t i = 0; i < FTP_NBR_CLIENTS; i ++ )
+      if( ftp_ses[ i ].ctrlconn == conn )
+      {
+        if( ftp_ses[ i ].state == SES_IDLE )
+          ses_post_i( & ftp_ses[ i ] );
+        else
+          ftp_ses[ i ].again = true;
+        break;
+      }
+#endif
   }
+  chSchRescheduleS();
+  chSysUnlock();
+}
+
+// Return the number of clients connected
+
+uint8_t ftp_nbr_sessions()
+{
+  uint8_t n = 0;
+
+#if FTP_EVENT_ENGINE
+  for( uint8_t i = 0; i < FTP_NBR_CLIENTS; i ++ )
+    if( ftp_ses[ i ].ctrlconn != NULL )
+      n ++;
+#else
+  for( uint8_t i = 0; i < FTP_NBR_CLIENTS; i ++ )
+    if( ss[ i ].ftpconn != NULL )
+      n ++;
+#endif
+  return n;
+}
+
+// =========================================================
+//
+//  Storage thread.
+//
+//  Reads and writes the files of all transfers, so that the SD card
+//    is accessed by one thread only:
+//  - reads requested by RETR, one chunk at a time
+//  - data received by STOR, gathered in large sequential writes
+//  Requests are served in the order of the sectors on the card, to
+//    limit the cost of switching from a file to another. A session
+//    passed over FTP_SCHED_MAX_SKIP times is served next.
+//
+// =========================================================
+
+static void storWrite( struct stor_ring * pr, char * data, uint16_t len )
+{
+  UINT nb;
+
+  systime_t t = chVTGetSystemTimeX();
+  if( pr->ferr == FR_OK )
+    pr->ferr = f_write( pr->file, data, len, & nb );
+  pr->timeFile += chVTGetSystemTimeX() - t;
+  pr->fileOps ++;
+}
+
+// Copy len bytes at data in the buffer of the ring and
+//   write it when full
+
+static void storCopy( struct stor_ring * pr, char * data, uint16_t len )
+{
+  while( len > 0 )
+  {
+    uint16_t copylen = pr->chunk - pr->off;
+    if( copylen > len )
+      copylen = len;
+    memcpy( pr->buf + pr->off, data, copylen );
+    data += copylen;
+    len -= copylen;
+    pr->off += copylen;
+    if( pr->off == pr->chunk )
+    {
+      storWrite( pr, pr->buf, pr->chunk );
+      pr->off = 0;
+    }
+  }
+}
+
+// Write all segments of a pbuf chain
+//
+// Whole sectors are written straight from the payload of the pbufs.
+//   Only the ragged head (up to the next sector boundary of the file)
+//   and tail of each segment are gathered in the buffer of the ring.
+//   The SDIO DMA needs word aligned data: else the driver would write
+//   sector by sector through its own buffer, so the whole segment is
+//   gathered too.
+
+static void storPbuf( struct stor_ring * pr, struct pbuf * pb )
+{
+  for( struct pbuf * q = pb; q != NULL; q = q->next )
+  {
+    char   * data = (char *) q->payload;
+    uint16_t len = q->len;
+    uint16_t head = ( _MAX_SS - ( f_tell( pr->file ) + pr->off ) % _MAX_SS ) % _MAX_SS;
+
+    if( len >= head + FTP_STOR_DIRECT_MIN && pr->off + head <= pr->chunk &&
+        ((uintptr_t) ( data + head ) & 3 ) == 0 )
+    {
+      if( head > 0 )
+      {
+        memcpy( pr->buf + pr->off, data, head );
+        pr->off += head;
+        data += head;
+        len -= head;
+      }
+      if( pr->off > 0 )
+      {
+        storWrite( pr, pr->buf, pr->off );
+        pr->off = 0;
+      }
+      uint16_t nb = len - len % _MAX_SS;
+      storWrite( pr, data, nb );
+      data += nb;
+      len -= nb;
+    }
+    storCopy( pr, data, len );
+  }
+}
+
+// Write the pbufs queued in a ring when the request was chosen
+
+static void storServe( struct stor_ring * pr )
+{
+  for( uint8_t n = pr->queued; n > 0; n -- )
+  {
+    struct pbuf * pb = pr->pb[ pr->tail ];
+    pr->tail = ( pr->tail + 1 ) % FTP_STOR_RING_SIZE;
+    chSysLock();
+    pr->queued --;
+    chSysUnlock();
+    if( pb != NULL )
+    {
+      storPbuf( pr, pb );
+      pbuf_free( pb );
+      chSemSignal( & ftp_stor_sem );
+      chSemSignal( & pr->semfree );
+    }
+    else
+    {
+      // End of transfer: write remaining data
+      if( pr->off > 0 )
+        storWrite( pr, pr->buf, pr->off );
+      chSemSignal( & pr->semfree );
+      chBSemSignal( & pr->semend );
+    }
+  }
+}
+
+// Choose the next request to serve
+//
+// return index of thread, or -1 if there is no request
+
+static int8_t schedPick( DWORD lastSect )
+{
+  int8_t   best = -1;
+  uint32_t bestDist = 0;
+  uint8_t  w;
+  FIL    * f;
+
+  for( w = 0; w < FTP_NBR_WORKERS; w ++ )
+  {
+    if( ss[ w ].rreq != NULL && ss[ w ].rreq->pending )
+      f = ss[ w ].rreq->file;
+    else if( ss[ w ].ring != NULL && ss[ w ].ring->queued > 0 )
+      f = ss[ w ].ring->file;
+    else
+      continue;
+    if( ss[ w ].skips >= FTP_SCHED_MAX_SKIP )
+    {
+      best = w;
+      ftpss.forced ++;
+      break;
+    }
+    // Distance ahead of the last sector accessed, wrapping
+    //   at the end of the card
+    uint32_t dist = f->dsect - lastSect;
+    if( best < 0 || dist < bestDist )
+    {
+      best = w;
+      bestDist = dist;
+    }
+  }
+  for( w = 0; w < FTP_NBR_WORKERS; w ++ )
+    if( w != best && (( ss[ w ].rreq != NULL && ss[ w ].rreq->pending ) ||
+                      ( ss[ w ].ring != NULL && ss[ w ].ring->queued > 0 )))
+      ss[ w ].skips ++;
+  if( best >= 0 )
+    ss[ best ].skips = 0;
+  return best;
+}
+
+THD_FUNCTION( ftp_storage, p )
+{
+  (void) p;
+  DWORD     lastSect = 0;
+  int8_t    w, last = -1;
+  uint8_t   n = 0;
+  systime_t t, tLast;
+
+  chRegSetThreadName( "ftp_storage" );
+
+  tLast = chVTGetSystemTimeX();
+  while( true )
+  {
+    w = schedPick( lastSect );
+    if( w < 0 )
+    {
+      chBSemWait( & ftp_storage_sem );
+      // Time without transfer is not counted
+      if( n == 0 )
+        tLast = chVTGetSystemTimeX();
+      continue;
+    }
+    if( w != last && last >= 0 )
+      ftpss.switches ++;
+    last = w;
+
+    uint32_t bytes;
+    struct read_req * rr = ss[ w ].rreq;
+    if( rr != NULL && rr->pending )
+    {
+      rr->res = f_read( rr->file, rr->buf, rr->len, & rr->nb );
+      lastSect = rr->file->dsect;
+      bytes = rr->nb;
+      ftpss.reads ++;
+      rr->pending = false;
+      chBSemSignal( & rr->done );
+    }
+    else
+    {
+      struct stor_ring * pr = ss[ w ].ring;
+      DWORD pos = f_tell( pr->file );
+      storServe( pr );
+      lastSect = pr->file->dsect;
+      bytes = f_tell( pr->file ) - pos;
+      ftpss.writes ++;
+    }
+
+    // Throughput by number of transfers running
+    n = 0;
+    for( uint8_t i = 0; i < FTP_NBR_WORKERS; i ++ )
+      if( ss[ i ].active )
+        n ++;
+    t = chVTGetSystemTimeX();
+    ftpss.bytes[ n ] += bytes;
+    ftpss.time[ n ] += t - tLast;
+    tLast = t;
+  }
+}
+
+// =========================================================
+//
+//  Callback of data connections.
+//
+//  Called by lwIP thread. Record the acknowledge progress of the
+//    data connection of a worker, and wake it up if it waits for
+//    the acknowledge of a file buffer.
+//  On passive listening connections, count the connections
+//    opened by the client and wake up ftp_server to accept them.
+//
+// =========================================================
+
+void ftp_data_event( struct netconn * conn, enum netconn_evt evt, u16_t len )
+{
+  (void) len;
+
+  if( evt == NETCONN_EVT_SENDPLUS )
+  {
+    for( uint8_t i = 0; i < FTP_NBR_WORKERS; i ++ )
+      if( ss[ i ].dataconn == conn )
+      {
+        if( conn->pcb.tcp == NULL )
+          ss[ i ].pcbGone = true;
+        else
+          ss[ i ].ackSeq = conn->pcb.tcp->lastack;
+        chBSemSignal( & ss[ i ].semack );
+        break;
+      }
+    return;
+  }
+  if( evt != NETCONN_EVT_RCVPLUS && evt != NETCONN_EVT_RCVMINUS )
+    return;
+  chSysLock();
+  for( uint8_t l = 0; l < FTP_PASV_LISTENERS; l ++ )
+    if( ftp_lst[ l ].conn == conn )
+    {
+      if( evt == NETCONN_EVT_RCVPLUS )
+      {
+        ftp_lst[ l ].avail ++;
+        ftp_lst[ l ].tConnect = chVTGetSystemTimeX();
+        chBSemSignalI( & ftp_server_sem );
+      }
+      else
+        ftp_lst[ l ].avail --;
+      break;
+    }
+  chSchRescheduleS();
+  chSysUnlock();
+}
+
+// =========================================================
+//
+//  Passive data connections.
+//
+// =========================================================
+
+// Open a listening connection on a port taken at random
+//   Must be called with ftp_pasv_mtx locked
+//
+// return false if no port could be bound
+
+static bool ftp_lst_open( struct pasv_listen * pl )
+{
+  struct netconn * conn;
+  uint16_t port;
+
+  // Data connections accepted inherit the callback
+  conn = netconn_new_with_callback( NETCONN_TCP, ftp_data_event );
+  if( conn == NULL )
+    return false;
+  port = FTP_DATA_PORT + chSysGetRealtimeCounterX() % FTP_PASV_PORTS;
+  for( uint8_t i = 0; i < 4; i ++ )
+  {
+    if( netconn_bind( conn, IP_ADDR_ANY, port ) == ERR_OK )
+    {
+      if( netconn_listen( conn ) != ERR_OK )
+        break;
+      // netconn_accept() is only called when a connection is waiting
+      netconn_set_recvtimeout( conn, MS2ST( FTP_EVENT_POLL ));
+      pl->avail = 0;
+      pl->waiting = 0;
+      pl->port = port;
+      pl->conn = conn;
+      return true;
+    }
+    port = FTP_DATA_PORT + ( port - FTP_DATA_PORT + 1 ) % FTP_PASV_PORTS;
+  }
+  netconn_delete( conn );
+  return false;
+}
+
+// Stop waiting for a passive data connection
+//   Must be called with ftp_pasv_mtx locked
+
+static void ftp_pasv_release( struct pasv_stru * pp )
+{
+  if( pp->lst < 0 )
+    return;
+  if( -- ftp_lst[ pp->lst ].waiting == 0 )
+    ftp_lst[ pp->lst ].tIdle = chVTGetSystemTimeX();
+  pp->lst = -1;
+}
+
+// Give to session n a listening connection, where no other session
+//   of the same client is waiting. A new one is opened if needed
+//
+// return the port of the connection, or 0 if none is available
+
+uint16_t ftp_pasv_open( uint8_t n, struct ip_addr * peer )
+{
+  struct pasv_stru * pp = & ftp_pasv[ n ];
+  int8_t l, unused = -1;
+
+  ftp_pasv_close( n );
+  chMtxLock( & ftp_pasv_mtx );
+  for( l = 0; l < FTP_PASV_LISTENERS; l ++ )
+  {
+    if( ftp_lst[ l ].conn == NULL )
+    {
+      if( unused < 0 )
+        unused = l;
+      continue;
+    }
+    uint8_t i;
+    for( i = 0; i < FTP_NBR_CLIENTS; i ++ )
+      if( ftp_pasv[ i ].lst == l && ip_addr_cmp( & ftp_pasv[ i ].peer, peer ))
+        break;
+    if( i == FTP_NBR_CLIENTS )
+      break;
+  }
+  if( l == FTP_PASV_LISTENERS && unused >= 0 && ftp_lst_open( & ftp_lst[ unused ]))
+    l = unused;
+  if( l < FTP_PASV_LISTENERS )
+  {
+    ftp_lst[ l ].waiting ++;
+    pp->lst = l;
+    pp->peer = * peer;
+    pp->tPasv = chVTGetSystemTimeX();
+  }
+  chMtxUnlock( & ftp_pasv_mtx );
+  return l < FTP_PASV_LISTENERS ? ftp_lst[ l ].port : 0;
+}
+
+// Close the data connection accepted and not used by session n,
+//   and stop waiting for one
+
+void ftp_pasv_close( uint8_t n )
+{
+  struct pasv_stru * pp = & ftp_pasv[ n ];
+  struct netconn * conn;
+
+  chMtxLock( & ftp_pasv_mtx );
+  ftp_pasv_release( pp );
+  chSysLock();
+  conn = pp->ready;
+  pp->ready = NULL;
+  chBSemResetI( & pp->semready, true );
+  chSysUnlock();
+  chMtxUnlock( & ftp_pasv_mtx );
+  if( conn != NULL )
+  {
+    netconn_close( conn );
+    netconn_delete( conn );
+  }
+}
+
+// Called by ftp_server: accept the data connections opened by clients,
+//   and give them to the session of the same client waiting on the
+//   listening connection
+
+static void ftp_pasv_accept()
+{
+  struct netconn * conn, * old;
+  struct ip_addr ip;
+  uint16_t port;
+
+  for( uint8_t l = 0; l < FTP_PASV_LISTENERS; l ++ )
+  {
+    struct pasv_listen * pl = & ftp_lst[ l ];
+
+    if( pl->avail <= 0 )
+      continue;
+    chMtxLock( & ftp_pasv_mtx );
+    if( pl->conn != NULL && netconn_accept( pl->conn, & conn ) == ERR_OK )
+    {
+      struct pasv_stru * pp = NULL;
+      old = conn;
+      if( netconn_peer( conn, & ip, & port ) == ERR_OK )
+        for( uint8_t i = 0; i < FTP_NBR_CLIENTS; i ++ )
+          if( ftp_pasv[ i ].lst == l && ip_addr_cmp( & ftp_pasv[ i ].peer, & ip ))
+          {
+            pp = & ftp_pasv[ i ];
+            break;
+          }
+      if( pp != NULL )
+      {
+        // Keep the last connection opened by the client
+        chSysLock();
+        old = pp->ready;
+        pp->ready = conn;
+        chBSemSignalI( & pp->semready );
+        chSchRescheduleS();
+        chSysUnlock();
+        // Update the mean time clients take to connect after PASV,
+        //   as TCP does for its round trip time (0 means not measured yet)
+        uint32_t m = ST2MS( pl->tConnect - pp->tPasv );
+        if( pp->srtt == 0 )
+        {
+          pp->srtt = m + 1;
+          pp->rttvar = m / 2;
+        }
+        else
+        {
+          pp->rttvar = ( 3 * pp->rttvar +
+                         ( m > pp->srtt ? m - pp->srtt : pp->srtt - m )) / 4;
+          pp->srtt = ( 7 * pp->srtt + m ) / 8 + 1;
+        }
+      }
+      else
+        // No session of this client is waiting
+        ftpps.stray ++;
+      if( old != NULL )
+      {
+        netconn_close( old );
+        netconn_delete( old );
+      }
+    }
+    chMtxUnlock( & ftp_pasv_mtx );
+  }
+}
+
+// Called by ftp_server: close the listening connections no session
+//   waited on for FTP_PASV_LINGER ms
+
+static void ftp_pasv_linger()
+{
+  systime_t t = chVTGetSystemTimeX();
+
+  chMtxLock( & ftp_pasv_mtx );
+  for( uint8_t l = 0; l < FTP_PASV_LISTENERS; l ++ )
+  {
+    struct pasv_listen * pl = & ftp_lst[ l ];
+    if( pl->conn != NULL && pl->waiting == 0 &&
+        t - pl->tIdle > MS2ST( FTP_PASV_LINGER ))
+    {
+      netconn_close( pl->conn );
+      netconn_delete( pl->conn );
+      pl->conn = NULL;
+    }
+  }
+  chMtxUnlock( & ftp_pasv_mtx );
+}
+
+// Wait for the passive data connection of session n
+//
+// return the connection, or NULL if the client did not open it in time
+
+struct netconn * ftp_pasv_wait( uint8_t n )
+{
+  struct pasv_stru * pp = & ftp_pasv[ n ];
+  struct netconn * conn;
+  uint32_t tmo;
+  systime_t t;
+  bool ready;
+
+  tmo = pp->srtt == 0 ? FTP_DATA_WAIT_INIT : pp->srtt + 4 * pp->rttvar;
+  if( tmo < FTP_DATA_WAIT_MIN )
+    tmo = FTP_DATA_WAIT_MIN;
+  else if( tmo > FTP_DATA_WAIT_MAX )
+    tmo = FTP_DATA_WAIT_MAX;
+  t = chVTGetSystemTimeX();
+  ready = chBSemWaitTimeout( & pp->semready, TIME_IMMEDIATE ) == MSG_OK;
+  if( ! ready )
+    chBSemWaitTimeout( & pp->semready, MS2ST( tmo ));
+  chMtxLock( & ftp_pasv_mtx );
+  ftp_pasv_release( pp );
+  chSysLock();
+  conn = pp->ready;
+  pp->ready = NULL;
+  chSysUnlock();
+  chMtxUnlock( & ftp_pasv_mtx );
+  t = chVTGetSystemTimeX() - t;
+  if( conn == NULL )
+  {
+    // Wait twice longer next time
+    pp->srtt = tmo;
+    pp->rttvar = tmo / 4;
+    ftpps.failed ++;
+  }
+  else if( ready )
+    ftpps.ready ++;
+  else
+  {
+    ftpps.waited ++;
+    ftpps.timeWait += ST2MS( t );
+  }
+  return conn;
+}
+
+// =========================================================
+//
+//  Bandwidth shaping.
+//
+//  RETR and STOR take from the bucket of the session and from the
+//    global bucket the bytes they send or receive, then sleep until
+//    both buckets are refilled, freeing the CPU for other sessions.
+//
+// =========================================================
+
+// Rate of a session, from the first rule matching user and address
+//
+// return rate in KB/s, 0 if unlimited
+
+uint16_t ftp_rate_of( const char * user, struct ip_addr * ip )
+{
+  uint32_t a = ( (uint32_t) ip4_addr1( ip ) << 24 ) | ( ip4_addr2( ip ) << 16 ) |
+               ( ip4_addr3( ip ) << 8 ) | ip4_addr4( ip );
+
+  for( uint8_t i = 0; i < sizeof( ftp_rate_rules ) / sizeof( rate_rule ); i ++ )
+  {
+    const struct rate_rule * pr = & ftp_rate_rules[ i ];
+    if( pr->user != NULL && strcmp( pr->user, user ))
+      continue;
+    uint32_t r = ( (uint32_t) pr->ip[ 0 ] << 24 ) | ( pr->ip[ 1 ] << 16 ) |
+                 ( pr->ip[ 2 ] << 8 ) | pr->ip[ 3 ];
+    uint32_t mask = pr->prefix == 0 ? 0 : 0xffffffff << ( 32 - pr->prefix );
+    if((( a ^ r ) & mask ) == 0 )
+      return pr->rate;
+  }
+  return 0;
+}
+
+void ftp_bucket_init( struct token_bucket * tb, uint16_t kbps )
+{
+  tb->rate = (uint32_t) kbps * 1024;
+  tb->tokens = (int64_t) tb->rate * MS2ST( FTP_RATE_BURST );
+  tb->tLast = chVTGetSystemTimeX();
+}
+
+void ftp_rate_set_global( uint16_t kbps )
+{
+  chMtxLock( & ftp_rate_mtx );
+  ftp_rate_global = kbps;
+  ftp_bucket_init( & ftp_rate_all, kbps );
+  chMtxUnlock( & ftp_rate_mtx );
+}
+
+// Take n bytes from a bucket
+//
+// return time until the bucket is no more in debt
+
+static systime_t bucket_take( struct token_bucket * tb, uint32_t n,
+                              systime_t now )
+{
+  if( tb->rate == 0 )
+    return 0;
+  int64_t full = (int64_t) tb->rate * MS2ST( FTP_RATE_BURST );
+  tb->tokens += (int64_t) tb->rate * (systime_t)( now - tb->tLast );
+  if( tb->tokens > full )
+    tb->tokens = full;
+  tb->tLast = now;
+  tb->tokens -= (int64_t) n * CH_CFG_ST_FREQUENCY;
+  if( tb->tokens >= 0 )
+    return 0;
+  return (systime_t)( - tb->tokens / tb->rate ) + 1;
+}
+
+// Account for n bytes transferred by a session, and sleep if it or
+//   all the sessions went beyond their rate
+//
+// return time slept
+
+systime_t ftp_rate_take( struct token_bucket * tb, uint32_t n )
+{
+  systime_t now = chVTGetSystemTimeX();
+  systime_t d = bucket_take( tb, n, now );
+
+  chMtxLock( & ftp_rate_mtx );
+  systime_t dg = bucket_take( & ftp_rate_all, n, now );
+  if( dg > d )
+    d = dg;
+  if( d > 0 )
+  {
+    ftprs.delays ++;
+    ftprs.timeDelay += ST2MS( d );
+  }
+  chMtxUnlock( & ftp_rate_mtx );
+  if( d > 0 )
+    chThdSleep( d );
+  return d;
+}
+
+// =========================================================
+//
+//  Hot file cache.
+//
+//  Shared by all sessions. A slot in use by a session (refs > 0)
+//    is never overwritten, as lwIP sends it without copy.
+//
+// =========================================================
+
+// Return true if path is name or is in directory name
+
+static bool hot_match( const char * path, const char * name )
+{
+  size_t l = strlen( name );
+
+  return strncmp( path, name, l ) == 0 && ( path[ l ] == 0 || path[ l ] == '/' );
+}
+
+// Look for a file in cache
+//   Date, time and size must be those given by f_stat()
+//
+// return index of slot, or -1 if not found
+//   The slot must be released with ftp_hot_release()
+
+int8_t ftp_hot_find( const char * path, FILINFO * pfi )
+{
+  int8_t slot = -1;
+
+  chMtxLock( & hot_mtx );
+  for( int8_t i = 0; i < FTP_HOT_FILE_NBR; i ++ )
+    if( hot[ i ].state == HOT_READY && ! strcmp( hot[ i ].path, path ))
+    {
+      if( hot[ i ].fdate == pfi->fdate && hot[ i ].ftime == pfi->ftime &&
+          hot[ i ].fsize == pfi->fsize )
+      {
+        hot[ i ].refs ++;
+        hot[ i ].used = ++ hot_counter;
+        ftp_hot_hits ++;
+        slot = i;
+      }
+      else
+        // File modified by another way than ftp
+        hot[ i ].state = hot[ i ].refs > 0 ? HOT_STALE : HOT_FREE;
+      break;
+    }
+  chMtxUnlock( & hot_mtx );
+  return slot;
+}
+
+// Reserve a slot to load a file
+//   The least recently used slot is replaced
+//
+// return index of slot, or -1 if file is too large or all slots are in use
+//   The caller reads the file in ftp_hot_data( slot ) then
+//   calls ftp_hot_loaded()
+
+int8_t ftp_hot_reserve( const char * path, FILINFO * pfi )
+{
+  int8_t slot = -1;
+
+  if( pfi->fsize > FTP_HOT_FILE_SIZE || strlen( path ) >= FTP_CWD_SIZE )
+    return -1;
+  chMtxLock( & hot_mtx );
+  for( int8_t i = 0; i < FTP_HOT_FILE_NBR; i ++ )
+  {
+    // Another session is already loading this file
+    if( hot[ i ].state == HOT_LOADING && ! strcmp( hot[ i ].path, path ))
+    {
+      slot = -1;
+      break;
+    }
+    if( hot[ i ].refs > 0 )
+      continue;
+    // Prefer a free slot, else the least recently used one
+    if( slot < 0 || ( hot[ slot ].state == HOT_READY &&
+        ( hot[ i ].state != HOT_READY || hot[ i ].used < hot[ slot ].used )))
+      slot = i;
+  }
+  if( slot >= 0 )
+  {
+    strcpy( hot[ slot ].path, path );
+    hot[ slot ].fdate = pfi->fdate;
+    hot[ slot ].ftime = pfi->ftime;
+    hot[ slot ].fsize = pfi->fsize;
+    hot[ slot ].state = HOT_LOADING;
+    hot[ slot ].refs = 1;
+    hot[ slot ].used = ++ hot_counter;
+  }
+  chMtxUnlock( & hot_mtx );
+  return slot;
+}
+
+// End loading of a slot
+//   If ok, the slot stays reserved by the caller
+
+void ftp_hot_loaded( int8_t slot, bool ok )
+{
+  chMtxLock( & hot_mtx );
+  if( ! ok )
+  {
+    hot[ slot ].state = HOT_FREE;
+    hot[ slot ].refs = 0;
+  }
+  else
+  {
+    if( hot[ slot ].state == HOT_LOADING )
+      hot[ slot ].state = HOT_READY;
+    ftp_hot_loads ++;
+  }
+  chMtxUnlock( & hot_mtx );
+}
+
+void ftp_hot_release( int8_t slot )
+{
+  chMtxLock( & hot_mtx );
+  if( hot[ slot ].refs > 0 )
+    hot[ slot ].refs --;
+  if( hot[ slot ].refs == 0 && hot[ slot ].state == HOT_STALE )
+    hot[ slot ].state = HOT_FREE;
+  chMtxUnlock( & hot_mtx );
+}
+
+// Remove from cache a file, or all files of a directory
+//   Must be called when a file is modified, deleted or renamed
+
+void ftp_hot_invalidate( const char * path )
+{
+  chMtxLock( & hot_mtx );
+  for( int8_t i = 0; i < FTP_HOT_FILE_NBR; i ++ )
+    if(( hot[ i ].state == HOT_READY || hot[ i ].state == HOT_LOADING ) &&
+       hot_match( hot[ i ].path, path ))
+      hot[ i ].state = hot[ i ].refs > 0 ? HOT_STALE : HOT_FREE;
+  chMtxUnlock( & hot_mtx );
+}
+
+char * ftp_hot_data( int8_t slot )
+{
+  return (char *) hot_buf[ slot ];
+}
+
+// =========================================================
+//
+//  Admission of clients.
+//
+// =========================================================
+
+// return index of a free slot, or -1 if all are used
+
+static int8_t ftp_free_slot()
+{
+  for( int8_t i = 0; i < FTP_NBR_CLIENTS; i ++ )
+#if FTP_EVENT_ENGINE
+    if( ftp_ses[ i ].state == SES_FREE )
+#else
+    if( ss[ i ].ftpconn == NULL )
+#endif
+      return i;
+  return -1;
+}
+
+// Start the session of a client in slot s
+//   t is the time the connection was accepted by lwIP
+
+static void ftp_start( int8_t s, struct netconn * conn, systime_t t )
+{
+  uint32_t ms = ST2MS( chVTGetSystemTimeX() - t );
+  uint8_t  b;
+
+  for( b = 0; b < FTP_ACCEPT_BINS - 1 && ms >= ftp_accept_bound[ b ]; b ++ )
+    ;
+  ftpas.hist[ b ] ++;
+  ftpas.accepted ++;
+  if( ms > ftpas.maxTime )
+    ftpas.maxTime = ms;
+
+#if FTP_EVENT_ENGINE
+  // A worker sends the welcome message
+  ftp_ses[ s ].login = LOGIN_NEW;
+  ftp_ses[ s ].expired = false;
+  ftp_ses[ s ].evicted = false;
+  ftp_ses[ s ].timeLast = chVTGetSystemTimeX();
+  chSysLock();
+  ftp_ses[ s ].ctrlconn = conn;
+  ses_post_i( & ftp_ses[ s ] );
+  chSchRescheduleS();
+  chSysUnlock();
+#else
+  // Wake up the corresponding thread
+  ss[ s ].ftpconn = conn;
+  chBSemSignal( & ss[ s ].semrequest );
+#endif
+}
+
+#if FTP_EVENT_ENGINE
+
+// return the number of sessions being closed by a worker
+
+static uint8_t ftp_closing()
+{
+  uint8_t n = 0;
+
+  for( uint8_t i = 0; i < FTP_NBR_CLIENTS; i ++ )
+    if( ftp_ses[ i ].expired && ftp_ses[ i ].state != SES_FREE )
+      n ++;
+  return n;
+}
+
+// Close the least recently active session, if it is idle for
+//   at least FTP_EVICT_IDLE seconds (FTP_EVICT_IDLE_LOGIN before login)
+//
+// return false if no session can be evicted
+
+static bool ftp_evict()
+{
+  systime_t t = chVTGetSystemTimeX();
+  int8_t e = -1;
+
+  chSysLock();
+  for( int8_t i = 0; i < FTP_NBR_CLIENTS; i ++ )
+    if( ftp_ses[ i ].state == SES_IDLE &&
+        t - ftp_ses[ i ].timeLast >= S2ST( ftp_ses[ i ].login == LOGIN_DONE ?
+                                           FTP_EVICT_IDLE : FTP_EVICT_IDLE_LOGIN ) &&
+        ( e < 0 || t - ftp_ses[ i ].timeLast > t - ftp_ses[ e ].timeLast ))
+      e = i;
+  if( e >= 0 )
+  {
+    ftp_ses[ e ].expired = true;
+    ftp_ses[ e ].evicted = true;
+    ses_post_i( & ftp_ses[ e ] );
+    ftpas.evicted ++;
+  }
+  chSchRescheduleS();
+  chSysUnlock();
+  return e >= 0;
+}
+
+#endif // FTP_EVENT_ENGINE
+
+// Refuse a client when there are too many
+
+static void ftp_refuse( struct netconn * conn )
+{
+  static const char msg[] = "421 Too many users, try later\r\n";
+
+  netconn_write( conn, msg, sizeof( msg ) - 1, NETCONN_NOCOPY );
+  netconn_close( conn );
+  netconn_delete( conn );
+  ftpas.refused ++;
+}
+
+#if CH_DBG_FILL_THREADS
+
+// Bytes of a stack still filled as at thread creation
+//   The stack grows down to the thread_t structure, at the start of
+//   the working area
+
+static uint32_t stack_unused( const void * wa )
+{
+  const uint8_t * base = (const uint8_t *) wa + sizeof( thread_t );
+  const uint8_t * p = base;
+
+  while( * p == CH_DBG_STACK_FILL_VALUE )
+    p ++;
+  return p - base;
+}
+
+void ftp_stack_unused( struct stack_stats * pst )
+{
+  pst->server = stack_unused( wa_ftp_server );
+  pst->storage = stack_unused( wa_ftp_storage );
+  pst->worker = sizeof( wa_ftp_conn[ 0 ] );
+  for( uint8_t i = 0; i < FTP_NBR_WORKERS; i ++ )
+  {
+    uint32_t n = stack_unused( wa_ftp_conn[ i ] );
+    if( n < pst->worker )
+      pst->worker = n;
+  }
+}
+
+#endif
+
+// Upper bound of the accept latency of pct % of the clients, in ms
+
+uint32_t ftp_accept_percentile( uint8_t pct )
+{
+  uint32_t n = 0, target = ( ftpas.accepted * pct + 99 ) / 100;
+  uint8_t  b;
+
+  for( b = 0; b < FTP_ACCEPT_BINS - 1; b ++ )
+  {
+    n += ftpas.hist[ b ];
+    if( n >= target )
+      break;
+  }
+  if( b == FTP_ACCEPT_BINS - 1 || ftp_accept_bound[ b ] > ftpas.maxTime )
+    return ftpas.maxTime;
+  return ftp_accept_bound[ b ];
 }
 
 // =========================================================
@@ -66,27 +1224,65 @@ THD_FUNCTION( ftp_conn, p )
 
 THD_FUNCTION( ftp_server, p )
 {
-  struct netconn * ftpsrvconn;
   uint8_t i;
 
   (void)p;
   chRegSetThreadName( "ftp_server" );
 
   //  Initialize ftp thread' parameters for each thread
-  for( i = 0; i < FTP_NBR_CLIENTS; i ++ )
+  for( i = 0; i < FTP_NBR_WORKERS; i ++ )
   {
     ss[ i ].num = i;
     ss[ i ].ftpconn = NULL;
     chBSemObjectInit( & ss[ i ].semrequest, true );
+    ss[ i ].dataconn = NULL;
+    chBSemObjectInit( & ss[ i ].semack, true );
+    chBSemObjectInit( & ss[ i ].semcall, true );
+    ss[ i ].pcbGone = true;
+    ss[ i ].ring = NULL;
+    ss[ i ].rreq = NULL;
+    ss[ i ].active = false;
+    ss[ i ].skips = 0;
+    ss[ i ].ctrlconn = NULL;
+    ss[ i ].ctrlRcv = false;
+  }
+  chMtxObjectInit( & hot_mtx );
+  chMtxObjectInit( & ftp_pasv_mtx );
+  chMtxObjectInit( & ftp_rate_mtx );
+  ftp_rate_set_global( FTP_RATE_GLOBAL );
+  for( i = 0; i < FTP_NBR_CLIENTS; i ++ )
+  {
+    ftp_pasv[ i ].lst = -1;
+    ftp_pasv[ i ].ready = NULL;
+    chBSemObjectInit( & ftp_pasv[ i ].semready, true );
+  }
+  for( i = 0; i < FTP_PASV_LISTENERS; i ++ )
+    ftp_lst[ i ].conn = NULL;
+#if FTP_EVENT_ENGINE
+  for( i = 0; i < FTP_NBR_CLIENTS; i ++ )
+  {
+    ftp_ses[ i ].num = i;
+    ftp_ses[ i ].ctrlconn = NULL;
+    ftp_ses[ i ].state = SES_FREE;
   }
+  chMBObjectInit( & ftp_ready_mb, ftp_ready_msg, FTP_NBR_CLIENTS );
+#endif
 
   //  Creates the FTP threads
-  for( i = 0; i < FTP_NBR_CLIENTS; i ++ )
+  for( i = 0; i < FTP_NBR_WORKERS; i ++ )
     chThdCreateStatic( wa_ftp_conn[ i ], sizeof( wa_ftp_conn[ i ] ),
                        FTP_THREAD_PRIORITY, ftp_conn, & ss[ i ] );
 
+  //  Creates the storage thread
+  chBSemObjectInit( & ftp_storage_sem, true );
+  chSemObjectInit( & ftp_stor_sem, FTP_STOR_QUEUE_MAX );
+  chThdCreateStatic( wa_ftp_storage, sizeof( wa_ftp_storage ),
+                     FTP_STORAGE_THREAD_PRIORITY, ftp_storage, NULL );
+
   // Create the TCP connection handle
-  ftpsrvconn = netconn_new( NETCONN_TCP );
+  //   Control connections accepted inherit the callback
+  chBSemObjectInit( & ftp_server_sem, true );
+  ftpsrvconn = netconn_new_with_callback( NETCONN_TCP, ftp_ctrl_event );
   LWIP_ERROR( "http_server: invalid ftpsrvconn", (ftpsrvconn != NULL), return; );
 
   // Bind to port 21 (FTP) with default IP address
@@ -98,17 +1294,74 @@ THD_FUNCTION( ftp_server, p )
   //  Goes to the final priority after initialization
   chThdSetPriority( FTP_THREAD_PRIORITY );
 
+  // netconn_accept() is only called when a connection is waiting
+  netconn_set_recvtimeout( ftpsrvconn, MS2ST( FTP_EVENT_POLL ));
   while( true )
   {
-    // Look for the first connection not used
-    for( i = 0; i < FTP_NBR_CLIENTS; i ++ )
-      if( ss[ i ].ftpconn == NULL )
+    struct netconn * conn;
+    systime_t t;
+    int8_t s;
+
+    // Wait for a new connection or the end of a session
+    //   Wake up every FTP_EVENT_TICK ms to close idle sessions
+    //   and listening connections
+    chBSemWaitTimeout( & ftp_server_sem, MS2ST( FTP_EVENT_TICK ));
+
+    // Start the sessions of the clients waiting for a free slot
+    while( ftp_pend_nbr > 0 && ( s = ftp_free_slot()) >= 0 )
+    {
+      struct pending_conn * pc = & ftp_pending[ ftp_pend_tail ];
+      ftp_pend_tail = ( ftp_pend_tail + 1 ) % FTP_PENDING_SIZE;
+      ftp_pend_nbr --;
+      ftp_start( s, pc->conn, pc->t );
+    }
+
+    // Accept the new clients. Those finding neither a free slot nor
+    //   room in the queue are told immediately to come back later
+    while( ftp_accept_avail > 0 )
+    {
+      chSysLock();
+      t = ftp_ts_tail != ftp_ts_head ?
+          ftp_accept_ts[ ftp_ts_tail ++ % FTP_ACCEPT_TS ] : chVTGetSystemTimeX();
+      chSysUnlock();
+      if( netconn_accept( ftpsrvconn, & conn ) != ERR_OK )
         break;
-    if( i == FTP_NBR_CLIENTS )
-      // All connections occupied
-      chThdSleepMilliseconds( 300 );
-    else if( netconn_accept( ftpsrvconn, & ss[ i ].ftpconn ) == ERR_OK )
-      // New client request, wake up the corresponding thread
-      chBSemSignal( & ss[ i ].semrequest );
+      if( ftp_pend_nbr == 0 && ( s = ftp_free_slot()) >= 0 )
+        ftp_start( s, conn, t );
+      else if( ftp_pend_nbr < FTP_PENDING_SIZE )
+      {
+        struct pending_conn * pc = & ftp_pending[( ftp_pend_tail + ftp_pend_nbr )
+                                                 % FTP_PENDING_SIZE ];
+        pc->conn = conn;
+        pc->t = t;
+        ftp_pend_nbr ++;
+        ftpas.queued ++;
+      }
+      else
+        ftp_refuse( conn );
+    }
+
+    // Accept the passive data connections opened by the clients
+    ftp_pasv_accept();
+    ftp_pasv_linger();
+
+#if FTP_EVENT_ENGINE
+    // Make room for the clients waiting, closing idle sessions
+    for( i = ftp_closing(); i < ftp_pend_nbr && ftp_evict(); i ++ )
+      ;
+
+    // Sessions idle for too long are closed by a worker
+    t = chVTGetSystemTimeX();
+    chSysLock();
+    for( i = 0; i < FTP_NBR_CLIENTS; i ++ )
+      if( ftp_ses[ i ].state == SES_IDLE &&
+          t - ftp_ses[ i ].timeLast > S2ST( ftp_ses[ i ].ctrlTime ))
+      {
+        ftp_ses[ i ].expired = true;
+        ses_post_i( & ftp_ses[ i ] );
+      }
+    chSchRescheduleS();
+    chSysUnlock();
+#endif
   }
 }
@@ -21,6 +21,7 @@
 #define _FTPS_H_
 
 #include "ch.h"
+#include "hal.h"
 
 #include "lwip/opt.h"
 #include "lwip/arch.h"
@@ -40,79 +41,572 @@
 #define FTP_TIME_OUT             10            // Disconnect client after 5 minutes of inactivity
 #define FTP_PARAM_SIZE           _MAX_LFN + 8
 #define FTP_CWD_SIZE             _MAX_LFN + 8  // max size of a directory name
+#define FTP_CMD_BUF_SIZE         ( FTP_PARAM_SIZE + 8 ) // max size of a command line
 
 // number of clients we want to serve simultaneously
 #define FTP_NBR_CLIENTS          5
+//#define FTP_NBR_CLIENTS          20          // with FTP_NBR_WORKERS 4
 
-// size of file buffer for reading a file
+// number of threads serving them
+//   With as many threads as clients, each client has its own thread.
+//   With fewer threads, control connections are driven by lwIP events
+//   (session engine): a thread (worker) is taken by a session only while
+//   it has a command to process or a transfer in progress, so a mostly
+//   idle client costs only its struct ftp_session.
+//   MEMP_NUM_TCP_PCB, MEMP_NUM_NETCONN and MEMP_NUM_TCP_PCB_LISTEN must
+//   be set accordingly in lwipopts.h (see FTP_NBR_TCP_PCB below)
+#define FTP_NBR_WORKERS          FTP_NBR_CLIENTS
+//#define FTP_NBR_WORKERS          4             // session engine
+#define FTP_EVENT_ENGINE         ( FTP_NBR_WORKERS < FTP_NBR_CLIENTS )
+
+// Number of clients waiting for a free slot. More are refused
+//   immediately with a 421 reply
+#define FTP_PENDING_SIZE         4
+
+// When all slots are used and clients are waiting, sessions idle for at
+//   least FTP_EVICT_IDLE seconds (FTP_EVICT_IDLE_LOGIN before login) are
+//   closed with a 421 reply, least recently active first.
+//   Session engine only
+#define FTP_EVICT_IDLE           60
+#define FTP_EVICT_IDLE_LOGIN     5
+
+// Time a worker waits for the end of a command line before releasing
+//   the session, in milliseconds
+#define FTP_EVENT_POLL           2
+// Period at which ftp_server looks for idle sessions, in milliseconds
+#define FTP_EVENT_TICK           1000
+
+// size of buffer for building responses and receiving files
 #define FTP_BUF_SIZE             512
 
-#define SERVER_THREAD_STACK_SIZE 256
+// size and number of file buffers used to send and receive files
+//   While lwIP sends one buffer, the next one is filled from the SD card
+//   Chunks are sized to the cluster of the volume, up to FTP_FILE_BUF_SIZE,
+//   so FatFs reads or writes them with one multiple block command
+#define FTP_FILE_BUF_SIZE        4096
+#define FTP_FILE_BUF_NBR         2
+
+// Passive data connections are accepted by FTP_PASV_LISTENERS listening
+//   connections shared by the sessions, on ports taken at random from
+//   FTP_DATA_PORT to FTP_DATA_PORT + FTP_PASV_PORTS - 1. Sessions of
+//   different clients wait on the same one, as data connections are
+//   given to the session of the client opening them. A listening
+//   connection no session waits on is closed after FTP_PASV_LINGER ms
+#define FTP_PASV_LISTENERS       4
+#define FTP_PASV_PORTS           256
+#define FTP_PASV_LINGER          2000          // in milliseconds
+
+// lwIP connections needed in the worst case: each session with its control
+//   and data connections, FTP_PENDING_SIZE clients waiting for a slot, one
+//   client being refused and one stray data connection being closed.
+//   Listening connections take no tcp_pcb but a netconn, as the NTP client
+//   does. MEMP_NUM_TCP_PCB must leave some room for closing connections
+#define FTP_NBR_TCP_PCB          ( 2 * FTP_NBR_CLIENTS + FTP_PENDING_SIZE + 2 )
+#define FTP_NBR_TCP_PCB_LISTEN   ( 1 + FTP_PASV_LISTENERS )
+#define FTP_NBR_NETCONN          ( FTP_NBR_TCP_PCB + FTP_NBR_TCP_PCB_LISTEN + 1 )
+
+#if MEMP_NUM_TCP_PCB < FTP_NBR_TCP_PCB
+#error "MEMP_NUM_TCP_PCB too small for FTP_NBR_CLIENTS"
+#endif
+#if MEMP_NUM_TCP_PCB_LISTEN < FTP_NBR_TCP_PCB_LISTEN
+#error "MEMP_NUM_TCP_PCB_LISTEN too small for FTP_PASV_LISTENERS"
+#endif
+#if MEMP_NUM_NETCONN < FTP_NBR_NETCONN
+#error "MEMP_NUM_NETCONN too small for FTP_NBR_CLIENTS"
+#endif
+
+// Time to wait for a passive data connection not yet opened when the
+//   transfer command arrives: the mean time the client took to connect
+//   after previous PASV replies, plus 4 times its mean deviation,
+//   within these limits
+#define FTP_DATA_WAIT_INIT       1000          // in milliseconds
+#define FTP_DATA_WAIT_MIN        100           // in milliseconds
+#define FTP_DATA_WAIT_MAX        5000          // in milliseconds
+
+// Maximum time to wait for the client to acknowledge a file buffer
+#define FTP_ACK_TIME_OUT         10000         // in milliseconds
+// lwIP does not signal every acknowledge, so check also periodically
+#define FTP_ACK_POLL             10            // in milliseconds
+
+// Bandwidth of RETR and STOR, in KB/s (0: unlimited)
+//   Each session has its own token bucket, and all of them share a
+//   global one of FTP_RATE_GLOBAL KB/s. The rate of a session is set at
+//   login by the first rule of FTP_RATE_RULES matching the user and the
+//   address of the client:
+//     { user (NULL: any), a, b, c, d, prefix length, rate }
+//   SITE RATE changes it for the session, SITE RATE GLOBAL for all
+#define FTP_RATE_GLOBAL          0
+#define FTP_RATE_RULES           { NULL, 192, 168, 0, 0, 16, 0 }, \
+                                 { NULL,   0,   0, 0, 0,  0, 0 }
+// Data a full bucket lets through at once: FTP_RATE_BURST ms at its rate
+#define FTP_RATE_BURST           100           // in milliseconds
+
+// Number of received pbufs each session can queue to ftp_storage
+#define FTP_STOR_RING_SIZE       8
+
+// Number of received pbufs all sessions together can queue to ftp_storage
+//   Each session holds one more while waiting to queue it. The other
+//   pbufs of PBUF_POOL_SIZE (see lwipopts.h), at least FTP_PBUF_SPARE,
+//   are left to receive control connections (ABOR) and other traffic
+//#define FTP_STOR_QUEUE_MAX       8           // with 4 workers
+#define FTP_STOR_QUEUE_MAX       7
+#define FTP_PBUF_SPARE           4
+
+#if FTP_STOR_QUEUE_MAX + FTP_NBR_WORKERS + FTP_PBUF_SPARE > PBUF_POOL_SIZE
+#error "FTP_STOR_QUEUE_MAX too large for PBUF_POOL_SIZE"
+#endif
+
+// Minimum number of bytes of a received segment written to file straight
+//   from the pbuf. Smaller segments are copied and gathered in chunks.
+//   Must be a multiple of 512. A value greater than TCP_MSS disables zero
+//   copy writing and gives fewer but larger writes to the SD card.
+//   Only word aligned data are written straight (see storPbuf()). With
+//   ETH_PAD_SIZE 0 (lwipopts.h), TCP payloads start 2 bytes off a word
+//   boundary, so a segment is aligned only by chance, and then gives a
+//   write of 1 or 2 sectors breaking the cluster sized ones: disabled.
+//   Try 1024 with ETH_PAD_SIZE 2, if the MAC driver handles the padding
+//#define FTP_STOR_DIRECT_MIN      1024
+#define FTP_STOR_DIRECT_MIN      2048          // > TCP_MSS: disabled
+
+// Hot file cache: files of up to FTP_HOT_FILE_SIZE bytes sent by RETR are
+//   kept in RAM and sent again without reading the SD card
+#define FTP_HOT_FILE_NBR         4
+#define FTP_HOT_FILE_SIZE        2048          // less than 65536
+
+// Size of cluster link map table used to restart transfers (see REST)
+//   A file with n fragments needs 2 * n + 1 items
+#define FTP_CLMT_SIZE            33
+
+// 1 to add command SITE BENCH, measuring the cost of finding a command
+#define FTP_BENCH                1
+
+// ST2MS() computes in 32 bits and overflows beyond 429 s at
+//   CH_CFG_ST_FREQUENCY 10000. Long durations and totals use this one
+#define FTP_ST2MS( n )           ( (uint32_t) (( (uint64_t) ( n ) * 1000 + \
+                                   CH_CFG_ST_FREQUENCY - 1 ) / CH_CFG_ST_FREQUENCY ))
+
+// With CH_DBG_FILL_THREADS, STAT gives the bytes of each stack never used
+//   since startup, to check these sizes under load
+//   ftp_server accepts and refuses clients, opens and closes passive
+//   listening connections: the lwIP API messages and the netconn calls
+//   need more than the former accept loop
+//#define SERVER_THREAD_STACK_SIZE 256
+#define SERVER_THREAD_STACK_SIZE 512
 //#define FTP_THREAD_STACK_SIZE    ( 1536 + FTP_BUF_SIZE + ( 5 * _MAX_LFN ))
-#define FTP_THREAD_STACK_SIZE    ( 1600 + FTP_BUF_SIZE + ( 5 * _MAX_LFN ))
+//#define FTP_THREAD_STACK_SIZE    ( 1600 + FTP_BUF_SIZE + ( 5 * _MAX_LFN ))
+//#define FTP_THREAD_STACK_SIZE    ( 1600 + FTP_BUF_SIZE + ( 6 * _MAX_LFN ))
+// A worker holds its FtpServer object, and the deepest call chain: a
+//   command walking a path with FatFs (LFN buffers are on the heap,
+//   _USE_LFN 3) through sdcache, or the lwIP API messages of a transfer.
+//   The size of the object follows the class; check the room left for
+//   the calls with the STAT reply
+#define FTP_THREAD_STACK_CALLS   1024
+#define FTP_THREAD_STACK_SIZE    ( sizeof( FtpServer ) + FTP_THREAD_STACK_CALLS )
 
 #define FTP_THREAD_PRIORITY      (LOWPRIO + 2)
 
+#define FTP_STORAGE_THREAD_STACK_SIZE 768
+#define FTP_STORAGE_THREAD_PRIORITY   (FTP_THREAD_PRIORITY + 1)
+
+// ftp_storage serves first the request nearest after the last sector
+//   accessed, unless a session was passed over FTP_SCHED_MAX_SKIP times
+#define FTP_SCHED_MAX_SKIP       2
+
 extern THD_WORKING_AREA( wa_ftp_server, SERVER_THREAD_STACK_SIZE );
 
+// File buffers of the ftp threads
+//   Word aligned so that the SDIO DMA transfers directly from/to them
+extern uint32_t ftp_file_buf[ FTP_NBR_WORKERS ][ FTP_FILE_BUF_NBR ][ FTP_FILE_BUF_SIZE / 4 ];
+
+struct stor_ring;
+struct read_req;
+
 // define a structure of parameters for a ftp thread
+//   (one per worker)
 struct server_stru
 {
   uint8_t num;
   // uint8_t fase;   // for debugging only
   struct netconn *ftpconn;
   binary_semaphore_t semrequest;
+  struct netconn *dataconn;       // data connection, if open
+  binary_semaphore_t semack;      // signaled when data are acknowledged
+  binary_semaphore_t semcall;     // signaled when a call made in lwIP thread is done
+  // Sequence numbers of dataconn, read in lwIP thread only, as it may
+  //   free the pcb at any time
+  uint32_t sndSeq;                // after the last byte queued
+  volatile uint32_t ackSeq;       // last byte acknowledged + 1
+  volatile bool pcbGone;          // pcb freed by lwIP, with its segments
+  struct stor_ring * ring;        // requests of the thread to ftp_storage
+  struct read_req  * rreq;
+  bool    active;                 // transfer in progress
+  struct netconn * ctrlconn;      // control connection, during a transfer
+  volatile bool ctrlRcv;          // bytes received on it since last poll
+  uint8_t skips;                  // times passed over by ftp_storage
+};
+
+enum dcm_type     // Data Connection mode:
+{
+  NOTSET  = 0,    //   not set
+  PASSIVE = 1,    //   passive
+  ACTIVE  = 2,    //   active
 };
 
+enum login_type   // Login state of a session:
+{
+  LOGIN_NEW  = 0, //   welcome message not sent yet
+  LOGIN_USER = 1, //   waiting for USER
+  LOGIN_PASS = 2, //   waiting for PASS
+  LOGIN_DONE = 3, //   logged in
+};
+
+// State of a client kept between its commands by the session engine
+//   The control connection belongs to the session, the data connection
+//   and the file buffers to the worker serving it
+struct ftp_session
+{
+  struct   netconn * ctrlconn;
+  uint8_t  num;                   // index of session
+  uint8_t  state;                 // SES_FREE, SES_IDLE, ... (see ftps.cpp)
+  bool     again;                 // bytes received while served
+  bool     expired;               // idle for too long, must be closed
+  bool     evicted;               // closed to serve a waiting client
+  login_type login;
+  uint16_t ctrlTime;              // inactivity delay, in seconds
+  systime_t timeLast;             // end of last command
+  struct   netbuf  * inbuf;
+  uint16_t inbufPos;
+  uint8_t  telnet;
+  char     cmdBuf[ FTP_CMD_BUF_SIZE ];
+  uint16_t cmdLen;
+  bool     cmdSkip;
+  struct   ip_addr ipclient;
+  struct   ip_addr ipserver;
+  struct   ip_addr ippeer;
+  uint16_t dataPort;
+  dcm_type dataConnMode;
+  char     cwdName[ FTP_CWD_SIZE ];
+  char     cwdRNFR[ FTP_CWD_SIZE ];
+  uint32_t allocSize;
+  uint32_t allocHint;
+  uint32_t restPos;
+  bool     fastSeek;
+  uint16_t fileBufSize;
+  uint8_t  fileBufNbr;
+  uint16_t rateKB;
+  systime_t timeBeginConnect;
+  RTCDateTime rtcBeginTime;
+};
+
+// Passive data connection of a session
+//   PASV gives the session a listening connection shared with other
+//   clients (see FTP_PASV_LISTENERS). ftp_server accepts the data
+//   connection as soon as the client opens it, so it is ready when
+//   the transfer command arrives
+struct pasv_stru
+{
+  int8_t   lst;                   // listening connection waited on, or -1
+  struct   ip_addr peer;          // address of client
+  struct netconn * ready;         // data connection accepted by ftp_server
+  binary_semaphore_t semready;    // signaled when ready is set
+  systime_t tPasv;                // time of last PASV reply
+  uint32_t srtt;                  // mean time to connect after PASV, in ms
+  uint32_t rttvar;                // mean deviation of srtt, in ms
+};
+
+// Statistics of passive data connections
+struct ftp_pasv_stru
+{
+  uint32_t ready;                 // accepted before the transfer command
+  uint32_t waited;                // accepted after it
+  uint32_t failed;                // not opened in time (425)
+  uint32_t stray;                 // opened by no client waiting
+  uint32_t timeWait;              // time spent waiting, in ms
+};
+
+// Rule giving the rate of sessions (see FTP_RATE_RULES)
+struct rate_rule
+{
+  const char * user;              // NULL for any user
+  uint8_t  ip[ 4 ];
+  uint8_t  prefix;                // number of bits of ip to compare
+  uint16_t rate;                  // in KB/s, 0: unlimited
+};
+
+// Token bucket limiting a flow of data
+//   Tokens are counted in bytes * CH_CFG_ST_FREQUENCY, so that refilling
+//   them at each tick loses nothing. They are negative when data were
+//   let through in advance; the sender then sleeps until they are back
+struct token_bucket
+{
+  uint32_t rate;                  // in bytes per second, 0: unlimited
+  int64_t  tokens;
+  systime_t tLast;                // time of last refill
+};
+
+// Statistics of bandwidth shaping
+struct ftp_rate_stru
+{
+  uint32_t delays;                // number of sleeps
+  uint32_t timeDelay;             // time slept, in ms
+};
+
+// Ring of pbufs received by a session, written to file by ftp_storage
+struct stor_ring
+{
+  struct pbuf * pb[ FTP_STOR_RING_SIZE ];
+  uint8_t  head;                  // next slot filled by the session
+  uint8_t  tail;                  // next slot written by ftp_storage
+  volatile uint8_t queued;        // number of slots filled
+  semaphore_t semfree;            // number of free slots
+  binary_semaphore_t semend;      // signaled when all data are written
+  FIL    * file;
+  char   * buf;                   // buffer where data are gathered
+  uint16_t chunk;                 // size of writes to file
+  uint16_t off;                   // number of bytes in buf
+  FRESULT  ferr;
+  uint32_t fileOps;
+  systime_t timeFile;
+};
+
+// Read of a file by a session, done by ftp_storage
+struct read_req
+{
+  FIL    * file;
+  char   * buf;
+  uint16_t len;
+  volatile bool pending;          // set by the session, cleared when done
+  UINT     nb;                    // number of bytes read
+  FRESULT  res;
+  binary_semaphore_t done;
+};
+
+// Statistics of ftp_storage
+struct ftp_sched_stru
+{
+  uint32_t reads;                 // f_read() done for sessions
+  uint32_t writes;                // runs of received data written
+  uint32_t switches;              // requests of another session than the previous one
+  uint32_t forced;                // requests served out of order for fairness
+  // Bytes read or written, and time spent, with n transfers running
+  uint32_t bytes[ FTP_NBR_WORKERS + 1 ];
+  systime_t time[ FTP_NBR_WORKERS + 1 ];
+};
+
+extern struct ftp_sched_stru ftpss;
+extern binary_semaphore_t ftp_storage_sem;
+extern semaphore_t ftp_stor_sem;
+
+// Hot file cache (see ftps.cpp)
+int8_t ftp_hot_find( const char * path, FILINFO * pfi );
+int8_t ftp_hot_reserve( const char * path, FILINFO * pfi );
+void   ftp_hot_loaded( int8_t slot, bool ok );
+void   ftp_hot_release( int8_t slot );
+void   ftp_hot_invalidate( const char * path );
+char * ftp_hot_data( int8_t slot );
+
+extern uint32_t ftp_hot_hits;
+extern uint32_t ftp_hot_loads;
+
+uint8_t ftp_nbr_sessions();
+
+// Passive data connections (see ftps.cpp)
+extern struct pasv_stru ftp_pasv[ FTP_NBR_CLIENTS ];
+extern struct ftp_pasv_stru ftpps;
+uint16_t ftp_pasv_open( uint8_t n, struct ip_addr * peer );
+struct netconn * ftp_pasv_wait( uint8_t n );
+void ftp_pasv_close( uint8_t n );
+
+// Statistics of the admission of clients
+#define FTP_ACCEPT_BINS          12            // bins of accept latencies
+struct ftp_accept_stru
+{
+  uint32_t accepted;              // sessions started
+  uint32_t queued;                // clients that waited for a free slot
+  uint32_t refused;               // clients refused with 421
+  uint32_t evicted;               // idle sessions closed to serve them
+  uint32_t maxTime;               // worst accept latency, in ms
+  uint32_t hist[ FTP_ACCEPT_BINS ];
+};
+
+// Bandwidth shaping (see ftps.cpp)
+extern struct ftp_rate_stru ftprs;
+extern uint16_t ftp_rate_global;
+uint16_t  ftp_rate_of( const char * user, struct ip_addr * ip );
+void      ftp_rate_set_global( uint16_t kbps );
+void      ftp_bucket_init( struct token_bucket * tb, uint16_t kbps );
+systime_t ftp_rate_take( struct token_bucket * tb, uint32_t n );
+
+extern struct ftp_accept_stru ftpas;
+uint32_t ftp_accept_percentile( uint8_t pct );
+extern const uint32_t ftp_worker_ram;
+
+#if CH_DBG_FILL_THREADS
+// Bytes of the stacks of the FTP threads never used since startup
+struct stack_stats
+{
+  uint32_t server;
+  uint32_t worker;                // least of all workers
+  uint32_t storage;
+};
+
+void ftp_stack_unused( struct stack_stats * pst );
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
   THD_FUNCTION( ftp_server, p );
+  THD_FUNCTION( ftp_storage, p );
+  void ftp_data_event( struct netconn * conn, enum netconn_evt evt, u16_t len );
+  void ftp_ctrl_event( struct netconn * conn, enum netconn_evt evt, u16_t len );
 #ifdef __cplusplus
 }
 #endif
 
-enum dcm_type     // Data Connection mode:
-{
-  NOTSET  = 0,    //   not set
-  PASSIVE = 1,    //   passive
-  ACTIVE  = 2,    //   active
-};
+// Send a constant response with its CRLF, from flash and without copy
+//   s must be a string literal
+#define SEND_CONST( s )          sendConst( s "\r\n", sizeof( s ) + 1 )
 
 class FtpServer
 {
 public:
+  // One thread per client: serve a client until it disconnects
   void service( int8_t n, struct netconn *dscn );
+  // Session engine: process the commands received by a session
+  //   return false when the session is closed
+  bool resume( int8_t n, struct ftp_session * ses );
 
 private:
+  // Entry of the table of commands
+  struct cmd_stru
+  {
+    uint32_t key;                         // name packed by FTP_CMD()
+    bool ( FtpServer::* handler )();      // return false to close session
+  };
+  static const cmd_stru commands[];
+
+  void sessionBegin( uint8_t nses, struct netconn * ctrlcn );
+  void sessionEnd();
+  void sessionLoad( struct ftp_session * ses );
+  void sessionSave( struct ftp_session * ses );
+  void ctrlTimeOut( uint16_t sec );
+  bool processLine();
   bool processCommand( char * command, char * parameters );
-  int8_t readCommand();
+  int8_t findCommand( const char * cmd );
+  int16_t readCommand();
+  int16_t readLine();
+  uint16_t telnetStrip( char * data, uint16_t len );
+
+  // Command handlers
+  bool cmdABOR();
+  bool cmdALLO();
+  bool cmdCDUP();
+  bool cmdCWD();
+  bool cmdDELE();
+  bool cmdFEAT();
+  bool cmdLIST();
+  bool cmdMDTM();
+  bool cmdMKD();
+  bool cmdMLSD();
+  bool cmdMODE();
+  bool cmdNOOP();
+  bool cmdPASV();
+  bool cmdPORT();
+  bool cmdPWD();
+  bool cmdQUIT();
+  bool cmdREST();
+  bool cmdRETR();
+  bool cmdRMD();
+  bool cmdRNFR();
+  bool cmdRNTO();
+  bool cmdSITE();
+  bool cmdSIZE();
+  bool cmdSTAT();
+  bool cmdSTOR();
+  bool cmdSTRU();
+  bool cmdTYPE();
+#if FTP_BENCH
+  void siteBench();
+#endif
 
   void sendBegin( const char * s );
   void sendCat( const char * s );
+  void sendCatNum( uint32_t n );
+  void sendCatIp( struct ip_addr * ip, char sep );
   void sendWrite( const char * s );
   void sendCatWrite( const char * s );
   void sendWrite();
+  void sendDefer();
+  void sendSpill();
+  void sendFlush();
+  void sendConst( const char * s, uint16_t len );
 
-  bool listenDataConn();
   bool dataConnect();
   void dataClose();
-  void dataWrite( const char * data );
+
+
+  // Zero copy sending of file buffers
+  //   A buffer given to dataSendBuf() is referenced by lwIP until
+  //   the client acknowledges it. dataWaitBuf() returns when it is free.
+  bool dataSendBuf( uint8_t nbuf, uint16_t nb );
+  bool dataSendRef( uint8_t nbuf, const void * data, uint16_t nb );
+  bool dataWaitBuf( uint8_t nbuf );
+  bool dataWaitAll();
+  bool dataSeq();
   void closeTransfer();
+  // The control connection is served between the chunks of RETR and STOR
+  void ctrlWatch( bool on );
+  bool ctrlPoll();
+  void sendTransferStatus();
 
   bool makePathFrom( char * fullName, char * param );
   bool makePath( char * fullName );
   bool fs_exists( char * path );
+  void workerInit( int8_t n );
+  FRESULT fileRead( char * data, uint16_t len, UINT * pnb );
+  void storBegin();
+  void storPush( struct pbuf * pb );
+  int8_t storEnd();
+
+  void sendFileError( FRESULT fr, const char * name );
+  int8_t hotFileFind( char * path );
+  int8_t hotFileLoad( char * path );
+  void hotFileSend( int8_t slot );
+
+  void listBegin();
+  void listCat( const char * s );
+  bool listEntry();
+  bool listSend( uint16_t nb );
+  bool listEnd();
+
   bool fs_opendir( DIR * pdir, char * dirName );
+  bool dirNext( DIR * pdir, int8_t slot, uint16_t * ppos );
+  uint16_t fileChunkSize();
+  bool filePrealloc( uint32_t size );
+  FRESULT fileClosePrealloc();
+  bool fileRestart();
+  void sendCatRestart();
+  void sendCatRate( uint16_t kbps );
 
   char * i2str( int32_t i );
   char * makeDateTimeStr( uint16_t date, uint16_t time );
   int8_t getDateTime( uint16_t * pdate, uint16_t * ptime );
 
-  struct    netconn * listdataconn, * dataconn, * ctrlconn;
-  struct    netbuf  * inbuf;
+  struct    netconn * dataconn, * ctrlconn;
+  struct    netbuf  * inbuf;                // received bytes not yet in cmdBuf
+  uint16_t  inbufPos;                       // position of those bytes in inbuf
+  uint8_t   telnet;                         // state of Telnet command parsing
+  char      cmdBuf[ FTP_CMD_BUF_SIZE ];     // command lines received
+  uint16_t  cmdLen;                         // number of bytes in cmdBuf
+  bool      cmdSkip;                        // discarding a line too long
   struct    ip_addr ipclient;
   struct    ip_addr ipserver;
+  struct    ip_addr ippeer;
+  login_type login;                       // login state
+  uint16_t  ctrlTime;                     // inactivity delay, in seconds
+  systime_t timeBeginConnect;
+  RTCDateTime rtcBeginTime;
 
   FIL       file;
   FILINFO   finfo;
@@ -126,11 +620,46 @@ private:
   char      cwdRNFR[ FTP_CWD_SIZE ];      // name of origin directory for Rename command
   char      path[ FTP_CWD_SIZE ];
   char      str[ 25 ];
+  uint32_t  allocSize;                    // size given by ALLO for next STOR
+  uint32_t  allocHint;                    // size given by SITE PREALLOC
+  uint32_t  restPos;                      // position given by REST
+  bool      fastSeek;                     // use cluster link map (SITE FASTSEEK)
+  DWORD     clmt[ FTP_CLMT_SIZE ];        // cluster link map table of file
+  uint32_t  seekPos;                      // position reached by fileRestart()
+  uint16_t  seekFrags;                    // number of fragments of file
+  systime_t timeSeek;                     // time spent moving to restPos
   systime_t timeBeginTrans;
   uint32_t  bytesTransfered;
   int8_t    nerr;
   uint8_t   num;
+  uint8_t   sesNum;                        // index of session
   char      buf[ FTP_BUF_SIZE ];           // data buffer for communication
+  uint16_t  bufLen;                        // length of response in buf
+  uint16_t  bufKeep;                       // length of deferred responses in buf
+  char    * fbuf[ FTP_FILE_BUF_NBR ];      // file buffers (in ftp_file_buf)
+  uint32_t  fbufSeq[ FTP_FILE_BUF_NBR ];   // TCP sequence number releasing each buffer
+  bool      fbufBusy[ FTP_FILE_BUF_NBR ];  // true while lwIP may read the buffer
+  uint16_t  fileBufSize;                   // size of chunks set by SITE BUFSIZE (0: auto)
+  uint8_t   fileBufNbr;                    // number of file buffers used (SITE BUFNBR)
+  uint16_t  chunkSize;                     // size of chunks of current transfer
+  uint32_t  fileOps;                       // number of f_read/f_write of current transfer
+  systime_t timeFile;                      // time spent reading/writing the SD card
+  systime_t timeNet;                       // time spent waiting for lwIP
+  struct stor_ring ring;                   // pbufs queued to ftp_storage
+  struct read_req rreq;                    // read requested to ftp_storage
+  uint16_t  storStalls;                    // number of times ring was full
+  systime_t timeStall;                     // time spent waiting for a free slot
+  uint16_t  rateKB;                        // rate of transfers (SITE RATE)
+  struct token_bucket bucket;              // shaping of current transfer
+  systime_t timeShape;                     // time slept by shaping
+  uint32_t  transferSize;                  // size of file sent, 0 if unknown
+  bool      aborted;                       // transfer stopped by ABOR
+  bool      ctrlHeld;                      // command waiting for the end of transfer
+  bool      ctrlLost;                      // control connection closed during transfer
+  uint8_t   listBuf;                       // file buffer receiving the listing
+  uint16_t  listLen;                       // number of bytes in that buffer
+  uint32_t  listEntries;                   // number of entries listed
+  uint32_t  listWrites;                    // number of segments sent
   uint16_t  pbuf;
   dcm_type  dataConnMode;
 };
@@ -22,13 +22,17 @@
 #include <stdlib.h>
 
 #include "ftps.h"
+#include "lwip/tcp.h"
+#include "lwip/tcpip.h"
 #include <ntpc/ntpc.h>
 #include <sdlog/sdlog.h>
+#include <sdcache/sdcache.h>
+#include <dircache/dircache.h>
 #include <util.h>
 
 extern bool   fast_blink;
 extern struct ntp_stru ntps;
-extern struct server_stru ss[ FTP_NBR_CLIENTS ];
+extern struct server_stru ss[ FTP_NBR_WORKERS ];
 
 // =========================================================
 //
@@ -36,15 +40,59 @@ extern struct server_stru ss[ FTP_NBR_CLIENTS ];
 //
 // =========================================================
 
+// Responses are built in buf. bufLen is the length of the response,
+//   always leaving room for the final CRLF.
+// bufKeep is the length of the previous responses kept by sendDefer(),
+//   sent in the same segment as the next one.
+
 void FtpServer::sendBegin( const char * s )
 {
-  strncpy( buf, s, FTP_BUF_SIZE );
+  bufLen = bufKeep;
+  sendCat( s );
 }
 
 void FtpServer::sendCat( const char * s )
 {
-  size_t len = FTP_BUF_SIZE - strlen( buf );
-  strncat( buf, s, len );
+  while( * s != 0 )
+  {
+    if( bufLen >= FTP_BUF_SIZE - 3 )
+      sendSpill();
+    buf[ bufLen ++ ] = * s ++;
+  }
+  buf[ bufLen ] = 0;
+}
+
+void FtpServer::sendCatNum( uint32_t n )
+{
+  char    digits[ 10 ];
+  uint8_t i = 0;
+
+  do
+  {
+    digits[ i ++ ] = '0' + n % 10;
+    n /= 10;
+  }
+  while( n > 0 );
+  if( bufLen + i > FTP_BUF_SIZE - 3 )
+    sendSpill();
+  while( i > 0 )
+    buf[ bufLen ++ ] = digits[ -- i ];
+  buf[ bufLen ] = 0;
+}
+
+// Append the 4 numbers of an IP address separated by sep
+
+void FtpServer::sendCatIp( struct ip_addr * ip, char sep )
+{
+  char s[ 2 ] = { sep, 0 };
+
+  sendCatNum( ip4_addr1( ip ));
+  sendCat( s );
+  sendCatNum( ip4_addr2( ip ));
+  sendCat( s );
+  sendCatNum( ip4_addr3( ip ));
+  sendCat( s );
+  sendCatNum( ip4_addr4( ip ));
 }
 
 void FtpServer::sendWrite( const char * s )
@@ -61,10 +109,66 @@ void FtpServer::sendCatWrite( const char * s )
 
 void FtpServer::sendWrite()
 {
-  if( strlen( buf ) + 2 < FTP_BUF_SIZE )
-    strcat( buf, "\r\n" );
-  netconn_write( ctrlconn, buf, strlen( buf ), NETCONN_COPY );
+  buf[ bufLen ++ ] = '\r';
+  buf[ bufLen ++ ] = '\n';
+  buf[ bufLen ] = 0;
+  netconn_write( ctrlconn, buf, bufLen, NETCONN_COPY );
+  COMMAND_PRINT( ">%u> %s", num, buf );
+  bufKeep = 0;
+}
+
+// Terminate the response without sending it. It will be sent
+//   in the same segment as the next one, or by sendFlush()
+
+void FtpServer::sendDefer()
+{
+  buf[ bufLen ++ ] = '\r';
+  buf[ bufLen ++ ] = '\n';
+  buf[ bufLen ] = 0;
+  bufKeep = bufLen;
+}
+
+// Send the beginning of a response too long for buf (as STAT), so that
+//   it is never truncated
+
+void FtpServer::sendSpill()
+{
+  netconn_write( ctrlconn, buf, bufLen, NETCONN_COPY );
+  buf[ bufLen ] = 0;
+  COMMAND_PRINT( ">%u> %s", num, buf );
+  bufLen = 0;
+  bufKeep = 0;
+}
+
+void FtpServer::sendFlush()
+{
+  if( bufKeep == 0 )
+    return;
+  netconn_write( ctrlconn, buf, bufKeep, NETCONN_COPY );
   COMMAND_PRINT( ">%u> %s", num, buf );
+  bufKeep = 0;
+}
+
+// Send a constant response (see SEND_CONST) without copying it
+
+void FtpServer::sendConst( const char * s, uint16_t len )
+{
+  // Keep order with deferred responses: append the response to them,
+  //   without its CRLF added back by sendWrite(), spilling as sendCat()
+  if( bufKeep > 0 )
+  {
+    bufLen = bufKeep;
+    for( ; len > 2; len -- )
+    {
+      if( bufLen >= FTP_BUF_SIZE - 3 )
+        sendSpill();
+      buf[ bufLen ++ ] = * s ++;
+    }
+    sendWrite();
+    return;
+  }
+  netconn_write( ctrlconn, s, len, NETCONN_NOCOPY );
+  COMMAND_PRINT( ">%u> %s", num, s );
 }
 
 //  Convert an integer to string
@@ -136,108 +240,161 @@ int8_t FtpServer::getDateTime( uint16_t * pdate, uint16_t * ptime )
 //
 // =========================================================
 
+// States of Telnet command parsing (see telnetStrip())
+#define TELNET_DATA              0
+#define TELNET_IAC               1             // IAC received
+#define TELNET_OPTION            2             // option code expected
+
+#define TELNET_IAC_BYTE          255
+#define TELNET_WILL              251           // WILL, WONT, DO, DONT
+
 // update variables command and parameters
 //
+// Bytes received are kept in cmdBuf until a whole line is available, so
+//   commands split across segments are accepted, and commands sent together
+//   in one segment are processed one after the other.
+//
 // return: -4 time out
 //         -3 error receiving data
 //         -2 command line too long
-//         -1 syntax error
 //          0 command without parameters
 //          >0 length of parameters
 
-int8_t FtpServer::readCommand()
+int16_t FtpServer::readCommand()
 {
-  char   * pbuf;
-  uint16_t buflen;
-  int8_t   rc = 0;
-  int8_t   i;
-  char     car;
+  char   * plf;
+  uint16_t nb;
+  int16_t  rc;
+  uint8_t  i;
 
   command[ 0 ] = 0;
   parameters[ 0 ] = 0;
-  nerr = netconn_recv( ctrlconn, & inbuf );
-  if( nerr == ERR_TIMEOUT )
-    return -4;
-  if( nerr != ERR_OK )
-    return -3;
-  netbuf_data( inbuf, (void **) & pbuf, & buflen );
-  if( buflen == 0 )
-    goto deletebuf;
-  i = 0;
-  car = pbuf[ 0 ];
-  do
-  {
-    if( ! isalpha( car ))
-      break;
-    command[ i ++ ] = car;
-    car = pbuf[ i ];
-  }
-  while( i < buflen && i < 4 );
+  if(( rc = readLine()) < 0 )
+    return rc;
+  plf = cmdBuf + rc;
+  rc = 0;
+  * plf = 0;
+  if( plf > cmdBuf && * ( plf - 1 ) == '\r' )
+    * ( plf - 1 ) = 0;
+  for( i = 0; i < 4 && isalpha( cmdBuf[ i ] ); i ++ )
+    command[ i ] = toupper( cmdBuf[ i ] );
   command[ i ] = 0;
-  if( car != ' ' )
-    goto deletebuf;
-  do
-    if( i > buflen + 2 )
-      goto deletebuf;
-  while( pbuf[ i ++ ] == ' ' );
-  rc = i;
-  do
-    car = pbuf[ rc ++ ];
-  while( car != '\n' && car != '\r' && rc < buflen );
-  if( rc == buflen )
-  {
-    rc = -1;
-    goto deletebuf;
-  }
-  if( rc - i - 1 >= FTP_PARAM_SIZE )
+  if( cmdBuf[ i ] == ' ' )
   {
-    rc = -2;
-    goto deletebuf;
+    while( cmdBuf[ i ] == ' ' )
+      i ++;
+    rc = strlen( cmdBuf + i );
+    if( rc >= FTP_PARAM_SIZE )
+      rc = -2;
+    else
+      strcpy( parameters, cmdBuf + i );
   }
-  strncpy( parameters, pbuf + i - 1, rc - i );
-  parameters[ rc - i ] = 0;
-  rc = rc - i;
-
-  deletebuf:
+  // Keep the bytes following the line
+  nb = cmdBuf + cmdLen - ( plf + 1 );
+  memmove( cmdBuf, plf + 1, nb );
+  cmdLen = nb;
   COMMAND_PRINT( "<%u< %s %s\r\n", num, command, parameters );
-  netbuf_delete( inbuf );
   return rc;
 }
 
-// =========================================================
+// Receive bytes until cmdBuf holds a whole line
+//   After a line too long, bytes are discarded up to its LF, so its end
+//   is not taken for a new command
 //
-//               Functions for data connection
-//
-// =========================================================
+// return: -4 time out
+//         -3 error receiving data
+//         -2 command line too long
+//         >= 0 position of the LF ending the line
 
-bool FtpServer::listenDataConn()
+int16_t FtpServer::readLine()
 {
-  bool ok = true;
+  char   * plf;
+  uint16_t nb;
 
-  // If this is not already done, create the TCP connection handle
-  //   to listen to client to open data connection
-  if( listdataconn == NULL )
+  while( true )
   {
-    listdataconn = netconn_new( NETCONN_TCP );
-    ok = listdataconn != NULL;
-    if( ok )
+    plf = (char *) memchr( cmdBuf, '\n', cmdLen );
+    if( cmdSkip )
     {
-      // Bind listdataconn to port (FTP_DATA_PORT+num) with default IP address
-      nerr = netconn_bind( listdataconn, IP_ADDR_ANY, dataPort );
-      ok = nerr == ERR_OK;
+      if( plf == NULL )
+        cmdLen = 0;
+      else
+      {
+        cmdSkip = false;
+        cmdLen = cmdBuf + cmdLen - ( plf + 1 );
+        memmove( cmdBuf, plf + 1, cmdLen );
+        continue;
+      }
     }
-    if( ok )
+    else if( plf != NULL )
+      return plf - cmdBuf;
+    else if( cmdLen == FTP_CMD_BUF_SIZE )
+    {
+      cmdLen = 0;
+      cmdSkip = true;
+      return -2;
+    }
+    // Receive more bytes. Those that do not fit in cmdBuf
+    //   are left in inbuf for next commands
+    if( inbuf == NULL )
+    {
+      nerr = netconn_recv( ctrlconn, & inbuf );
+      if( nerr != ERR_OK )
+      {
+        inbuf = NULL;
+        return nerr == ERR_TIMEOUT ? -4 : -3;
+      }
+      inbufPos = 0;
+    }
+    nb = netbuf_copy_partial( inbuf, cmdBuf + cmdLen,
+                              FTP_CMD_BUF_SIZE - cmdLen, inbufPos );
+    inbufPos += nb;
+    cmdLen += telnetStrip( cmdBuf + cmdLen, nb );
+    if( inbufPos >= netbuf_len( inbuf ))
     {
-      // Put the connection into LISTEN state
-      nerr = netconn_listen( listdataconn );
-      ok = nerr == ERR_OK;
+      netbuf_delete( inbuf );
+      inbuf = NULL;
     }
   }
-  if( ! ok )
-    DEBUG_PRINT( "Error in listenDataConn()\r\n" );
-  return ok;
 }
 
+// Remove Telnet commands from len bytes received at data
+//   Clients send IAC IP and IAC DM (Synch) before ABOR. Options
+//   negotiation (IAC WILL/WONT/DO/DONT option) is ignored too
+//
+// return number of bytes left
+
+uint16_t FtpServer::telnetStrip( char * data, uint16_t len )
+{
+  uint16_t j = 0;
+
+  for( uint16_t i = 0; i < len; i ++ )
+  {
+    uint8_t c = data[ i ];
+    if( telnet == TELNET_IAC )
+    {
+      telnet = TELNET_DATA;
+      if( c == TELNET_IAC_BYTE )          // IAC IAC is a byte 255
+        data[ j ++ ] = c;
+      else if( c >= TELNET_WILL )
+        telnet = TELNET_OPTION;
+    }
+    else if( telnet == TELNET_OPTION )
+      telnet = TELNET_DATA;
+    else if( c == TELNET_IAC_BYTE )
+      telnet = TELNET_IAC;
+    else
+      data[ j ++ ] = c;
+  }
+  return j;
+}
+
+// =========================================================
+//
+//               Functions for data connection
+//
+// =========================================================
+
 bool FtpServer::dataConnect()
 {
   nerr = ERR_CONN;
@@ -252,21 +409,24 @@ bool FtpServer::dataConnect()
 
   if( dataConnMode == PASSIVE )
   {
-    if( listdataconn == NULL )
+    if( ftp_pasv[ sesNum ].lst < 0 )
       goto error;
-    // Wait for connection from client during 500 ms
-    netconn_set_recvtimeout( listdataconn, MS2ST( 500 ));
-    nerr = netconn_accept( listdataconn, & dataconn );
-    if( nerr != ERR_OK )
+    // The connection is usually accepted by ftp_server before the
+    //   command, else wait for it (see ftp_pasv_wait())
+    dataconn = ftp_pasv_wait( sesNum );
+    if( dataconn == NULL )
     {
       DEBUG_PRINT( "Error in dataConnect(): netconn_accept\r\n" );
       goto error;
     }
+    // Port given by PASV, for the 150 reply
+    struct ip_addr ip;
+    netconn_addr( dataconn, & ip, & dataPort );
   }
   else
   {
     //  Create a new TCP connection handle
-    dataconn = netconn_new( NETCONN_TCP );
+    dataconn = netconn_new_with_callback( NETCONN_TCP, ftp_data_event );
     if( dataconn == NULL )
     {
       DEBUG_PRINT( "Error in dataConnect(): netconn_new\r\n" );
@@ -289,6 +449,10 @@ bool FtpServer::dataConnect()
       goto delconn;
     }
   }
+  chBSemReset( & ss[ num ].semack, true );
+  ss[ num ].dataconn = dataconn;
+  ss[ num ].pcbGone = false;
+  dataSeq();
   return true;
 
   delconn:
@@ -299,24 +463,245 @@ bool FtpServer::dataConnect()
   }
 
   error:
-  sendWrite( "425 No data connection" );
+  SEND_CONST( "425 No data connection" );
   return false;
 }
 
+// Called by lwIP thread: reset the data connection of a worker, so that
+//   lwIP frees the segments still referencing its file buffers
+
+static void ftp_data_abort( void * arg )
+{
+  struct server_stru * pss = (struct server_stru *) arg;
+
+  if( pss->dataconn != NULL && pss->dataconn->pcb.tcp != NULL )
+    tcp_abort( pss->dataconn->pcb.tcp );
+  pss->pcbGone = true;
+  chBSemSignal( & pss->semcall );
+}
+
+// Called by lwIP thread: read the sequence numbers of the data connection
+//   of a worker. Only this thread may read the pcb, that it can free
+//   at any time (reset by the client, tcp_abort())
+
+static void ftp_data_seq( void * arg )
+{
+  struct server_stru * pss = (struct server_stru *) arg;
+  struct tcp_pcb * pcb = pss->dataconn != NULL ? pss->dataconn->pcb.tcp : NULL;
+
+  if( pcb == NULL )
+    pss->pcbGone = true;
+  else
+  {
+    pss->sndSeq = pcb->snd_lbb;
+    pss->ackSeq = pcb->lastack;
+  }
+  chBSemSignal( & pss->semcall );
+}
+
+// Update sndSeq and ackSeq of the data connection
+//
+// return false if lwIP freed the connection
+
+bool FtpServer::dataSeq()
+{
+  chBSemReset( & ss[ num ].semcall, true );
+  if( tcpip_callback( ftp_data_seq, & ss[ num ] ) == ERR_OK )
+    chBSemWait( & ss[ num ].semcall );
+  return ! ss[ num ].pcbGone;
+}
+
 void FtpServer::dataClose()
 {
   dataConnMode = NOTSET;
   if( dataconn == NULL )
+  {
+    ss[ num ].dataconn = NULL;
     return;
+  }
+  // Buffers still referenced by lwIP must not be reused
+  dataWaitAll();
+  ss[ num ].dataconn = NULL;
   netconn_close( dataconn );
   netconn_delete( dataconn );
   dataconn = NULL;
 }
 
-void FtpServer::dataWrite( const char * data )
+
+// Send nb bytes of file buffer nbuf without copying them into lwIP heap
+//   The buffer must not be modified until dataWaitBuf() returns
+//
+// return true if data are queued
+
+bool FtpServer::dataSendBuf( uint8_t nbuf, uint16_t nb )
+{
+  return dataSendRef( nbuf, fbuf[ nbuf ], nb );
+}
+
+// Same as dataSendBuf() for data outside of the file buffers
+//   Acknowledge of those data is tracked in slot nbuf
+
+bool FtpServer::dataSendRef( uint8_t nbuf, const void * data, uint16_t nb )
+{
+  nerr = netconn_write( dataconn, data, nb, NETCONN_NOCOPY );
+  // When the client has acknowledged up to the sequence number of the
+  //   next byte to be buffered, lwIP does not reference the buffer any more
+  //   Part of the data may be queued even if netconn_write() failed
+  if( dataSeq())
+  {
+    fbufSeq[ nbuf ] = ss[ num ].sndSeq;
+    fbufBusy[ nbuf ] = true;
+  }
+  return nerr == ERR_OK;
+}
+
+// Wait until all data sent from file buffer nbuf have been acknowledged
+//
+// return false on time out
+
+bool FtpServer::dataWaitBuf( uint8_t nbuf )
+{
+  systime_t timeBegin = chVTGetSystemTimeX();
+
+  while( fbufBusy[ nbuf ] )
+  {
+    // If connection was aborted, lwIP has already freed the segments
+    if( ss[ num ].pcbGone ||
+        (int32_t) ( ss[ num ].ackSeq - fbufSeq[ nbuf ] ) >= 0 )
+      fbufBusy[ nbuf ] = false;
+    else if( chVTGetSystemTimeX() - timeBegin > MS2ST( FTP_ACK_TIME_OUT ))
+    {
+      DEBUG_PRINT( "Time out waiting for acknowledge of buffer %u\r\n", nbuf );
+      return false;
+    }
+    // ftp_data_event() does not see every acknowledge
+    else if( chBSemWaitTimeout( & ss[ num ].semack,
+                                MS2ST( FTP_ACK_POLL )) == MSG_TIMEOUT )
+      dataSeq();
+  }
+  return true;
+}
+
+// Wait until all file buffers are released
+//   Must be called before closing the data connection
+
+bool FtpServer::dataWaitAll()
+{
+  for( uint8_t i = 0; i < FTP_FILE_BUF_NBR; i ++ )
+    if( ! dataWaitBuf( i ))
+    {
+      // The client does not answer any more. Reset the connection so
+      //   that lwIP does not retransmit from the buffers any more
+      chBSemReset( & ss[ num ].semcall, true );
+      if( tcpip_callback( ftp_data_abort, & ss[ num ] ) == ERR_OK )
+        chBSemWait( & ss[ num ].semcall );
+      for( i = 0; i < FTP_FILE_BUF_NBR; i ++ )
+        fbufBusy[ i ] = false;
+      return false;
+    }
+  return true;
+}
+
+// =========================================================
+//
+//            Requests to the storage thread
+//
+// =========================================================
+
+// Attach the requests of the worker to ftp_storage
+
+void FtpServer::workerInit( int8_t n )
+{
+  num = n;
+  aborted = false;
+  if( ss[ num ].rreq != & rreq )
+  {
+    ring.queued = 0;
+    rreq.pending = false;
+    chBSemObjectInit( & rreq.done, true );
+    ss[ num ].ring = & ring;
+    ss[ num ].rreq = & rreq;
+  }
+}
+
+// Read from the file through ftp_storage
+//
+// return the FatFs result of f_read()
+
+FRESULT FtpServer::fileRead( char * data, uint16_t len, UINT * pnb )
+{
+  rreq.file = & file;
+  rreq.buf = data;
+  rreq.len = len;
+  rreq.pending = true;
+  chBSemSignal( & ftp_storage_sem );
+  chBSemWait( & rreq.done );
+  * pnb = rreq.nb;
+  return rreq.res;
+}
+
+// Prepare the ring of received pbufs for a new transfer
+
+void FtpServer::storBegin()
+{
+  ring.head = 0;
+  ring.tail = 0;
+  ring.queued = 0;
+  chSemObjectInit( & ring.semfree, FTP_STOR_RING_SIZE );
+  chBSemObjectInit( & ring.semend, true );
+  ring.file = & file;
+  ring.buf = fbuf[ 0 ];
+  ring.chunk = chunkSize;
+  ring.off = 0;
+  ring.ferr = FR_OK;
+  ring.fileOps = 0;
+  ring.timeFile = 0;
+  storStalls = 0;
+  timeStall = 0;
+}
+
+// Queue a received pbuf (or NULL at end of transfer) for ftp_storage
+
+void FtpServer::storPush( struct pbuf * pb )
+{
+  // Ring is full because the SD card is busy, or sessions hold together
+  //   FTP_STOR_QUEUE_MAX pbufs. Until a slot is freed, received data
+  //   stay in lwIP and the receive window closes
+  if( chSemWaitTimeout( & ring.semfree, TIME_IMMEDIATE ) != MSG_OK )
+  {
+    systime_t t = chVTGetSystemTimeX();
+    storStalls ++;
+    chSemWait( & ring.semfree );
+    timeStall += chVTGetSystemTimeX() - t;
+  }
+  if( pb != NULL &&
+      chSemWaitTimeout( & ftp_stor_sem, TIME_IMMEDIATE ) != MSG_OK )
+  {
+    systime_t t = chVTGetSystemTimeX();
+    storStalls ++;
+    chSemWait( & ftp_stor_sem );
+    timeStall += chVTGetSystemTimeX() - t;
+  }
+  ring.pb[ ring.head ] = pb;
+  ring.head = ( ring.head + 1 ) % FTP_STOR_RING_SIZE;
+  chSysLock();
+  ring.queued ++;
+  chBSemSignalI( & ftp_storage_sem );
+  chSchRescheduleS();
+  chSysUnlock();
+}
+
+// Wait for ftp_storage to write all queued data
+//
+// return the FatFs result of writing
+
+int8_t FtpServer::storEnd()
 {
-  netconn_write( dataconn, data, strlen( data ), NETCONN_COPY );
-  // COMMAND_PRINT( data );
+  storPush( NULL );
+  chBSemWait( & ring.semend );
+  fileOps = ring.fileOps;
+  timeFile = ring.timeFile;
+  return ring.ferr;
 }
 
 // =========================================================
@@ -360,7 +745,7 @@ bool FtpServer::makePathFrom( char * fullName, char * param )
     fullName[ strl ] = 0;
   if( strlen( fullName ) < FTP_CWD_SIZE )
     return true;
-  sendWrite( "500 Command line too long" );
+  SEND_CONST( "500 Command line too long" );
   return false;
 }
 
@@ -372,11 +757,54 @@ bool FtpServer::makePath( char * fullName )
 void FtpServer::closeTransfer()
 {
   uint32_t deltaT = (uint32_t) ( chVTGetSystemTimeX() - timeBeginTrans );
-  if( deltaT > 0 && bytesTransfered > 0 )
+  if( aborted )
+  {
+    sendBegin( "426 Transfer aborted after " );
+    sendCatNum( bytesTransfered );
+    sendCat( " bytes\r\n" );
+    sendCatWrite( "226 ABOR successful" );
+    aborted = false;
+  }
+  else if( deltaT > 0 && bytesTransfered > 0 )
   {
     sendBegin( "226-File successfully transferred\r\n" );
+    // Time spent waiting for the SD card and for the network
+    //   Their sum is greater than the transfer time when both overlap
+    if( fileOps > 0 )
+    {
+      sendCat( "226-SD " );
+      sendCatNum( FTP_ST2MS( timeFile ));
+      sendCat( " ms, net " );
+      sendCatNum( FTP_ST2MS( timeNet ));
+      sendCat( " ms, chunks of " );
+      sendCatNum( chunkSize );
+      sendCat( " bytes, " );
+      // Average number of sectors read or written by each f_read/f_write
+      uint32_t spc10 = ( bytesTransfered * 10 / 512 ) / fileOps;
+      sendCatNum( spc10 / 10 );
+      sendCat( "." );
+      sendCatNum( spc10 % 10 );
+      sendCat( " sectors per command\r\n" );
+    }
+    // Number of times the receive window was closed because
+    //   the storage thread was late
+    if( storStalls > 0 )
+    {
+      sendCat( "226-" );
+      sendCatNum( storStalls );
+      sendCat( " window stalls for " );
+      sendCatNum( FTP_ST2MS( timeStall ));
+      sendCat( " ms\r\n" );
+    }
+    // Time slept to keep to the rate of the session and the global one
+    if( timeShape > 0 )
+    {
+      sendCat( "226-Shaped for " );
+      sendCatNum( FTP_ST2MS( timeShape ));
+      sendCat( " ms\r\n" );
+    }
     sendCat( "226 " );
-    sendCat( i2str( deltaT ));
+    sendCatNum( deltaT );
     sendCat( " ms, " );
     uint32_t bps;
     if( bytesTransfered < 0x7fffffff / CH_CFG_ST_FREQUENCY )
@@ -385,17 +813,114 @@ void FtpServer::closeTransfer()
       bps = ( bytesTransfered / deltaT ) * CH_CFG_ST_FREQUENCY;
     if( bps > 10000 )
     {
-      sendCat( i2str( bps / 1000 ));
+      sendCatNum( bps / 1000 );
       sendCatWrite( " kbytes/s" );
     }
     else
     {
-      sendCat( i2str( bps ));
+      sendCatNum( bps );
       sendCatWrite( " bytes/s" );
     }
   }
   else
-    sendWrite( "226 File successfully transferred" );
+    SEND_CONST( "226 File successfully transferred" );
+}
+
+// Watch the control connection during a transfer (on) or not (off)
+//   Bytes may have been received before, so the first poll reads it,
+//   waiting FTP_EVENT_POLL ms at most
+
+void FtpServer::ctrlWatch( bool on )
+{
+  ctrlHeld = false;
+  ctrlLost = false;
+  chSysLock();
+  ss[ num ].ctrlconn = on ? ctrlconn : NULL;
+  ss[ num ].ctrlRcv = on;
+  chSysUnlock();
+  if( on )
+    netconn_set_recvtimeout( ctrlconn, MS2ST( FTP_EVENT_POLL ));
+  else
+    ctrlTimeOut( ctrlTime );
+}
+
+// Serve the control connection between two chunks of a transfer
+//   NOOP and STAT are answered, ABOR stops the transfer. Another command
+//   is left in cmdBuf, with the ones following it, until the transfer ends
+//
+// return false if the transfer must stop
+
+bool FtpServer::ctrlPoll()
+{
+  int16_t rc;
+  char    name[ 5 ];
+  uint8_t i;
+
+  if( ctrlHeld ||
+      ( ! ss[ num ].ctrlRcv && memchr( cmdBuf, '\n', cmdLen ) == NULL ))
+    return true;
+  ss[ num ].ctrlRcv = false;
+  while(( rc = readLine()) != -4 )
+  {
+    if( rc == -3 )            // control connection closed
+    {
+      ctrlLost = true;
+      return false;
+    }
+    if( rc == -2 )
+    {
+      SEND_CONST( "500 Syntax error" );
+      continue;
+    }
+    for( i = 0; i < 4 && isalpha( cmdBuf[ i ] ); i ++ )
+      name[ i ] = toupper( cmdBuf[ i ] );
+    name[ i ] = 0;
+    if( strcmp( name, "ABOR" ) && strcmp( name, "STAT" ) && strcmp( name, "NOOP" ))
+    {
+      ctrlHeld = true;
+      return true;
+    }
+    if( readCommand() < 0 )
+      SEND_CONST( "500 Syntax error" );
+    else if( ! strcmp( command, "ABOR" ))
+    {
+      aborted = true;
+      return false;
+    }
+    else if( ! strcmp( command, "NOOP" ))
+      cmdNOOP();
+    else
+      sendTransferStatus();
+  }
+  return true;
+}
+
+// Reply to STAT during a transfer with its progress
+
+void FtpServer::sendTransferStatus()
+{
+  uint32_t ms = FTP_ST2MS( chVTGetSystemTimeX() - timeBeginTrans );
+
+  sendBegin( "213-Transfer in progress\r\n " );
+  sendCat( path );
+  sendCat( ": " );
+  sendCatNum( bytesTransfered );
+  if( transferSize > 0 )
+  {
+    sendCat( " of " );
+    sendCatNum( transferSize );
+  }
+  sendCat( " bytes in " );
+  sendCatNum( ms );
+  sendCat( " ms" );
+  if( ms > 0 )
+  {
+    sendCat( ", " );
+    sendCatNum( bytesTransfered / ms );
+    sendCat( " kbytes/s" );
+  }
+  sendCat( "\r\n" );
+  sendCatWrite( "213 End of status" );
 }
 
 // Return true if a file or directory exists
@@ -408,9 +933,7 @@ bool FtpServer::fs_exists( char * path )
   if( ! strcmp( path, "/" ) )
     return true;
 
-  char *  path0 = path;
-
-  return f_stat( path0, & finfo ) == FR_OK;
+  return dircacheStat( path, & finfo ) == FR_OK;
 }
 
 // Open a directory
@@ -429,730 +952,1547 @@ bool FtpServer::fs_opendir( DIR * pdir, char * dirName )
   return ffs_result == FR_OK;
 }
 
-// =========================================================
+// Read next entry of a directory in finfo, from the directory cache
+//   if slot is not negative
 //
-//                   Process a command
+// return false after last entry
+
+bool FtpServer::dirNext( DIR * pdir, int8_t slot, uint16_t * ppos )
+{
+  if( slot >= 0 )
+    return dircacheRead( slot, ppos, & finfo );
+  return f_readdir( pdir, & finfo ) == FR_OK && finfo.fname[0] != 0;
+}
+
+// Allocate clusters to the file just created before receiving its data
 //
-// =========================================================
+// Moving the file pointer beyond the end of a file open for writing makes
+//   FatFs link all the clusters at once, contiguous if the free space of
+//   the volume allows it. Then writing the data does not update the FAT.
+//   The file is truncated by fileClosePrealloc() whatever the end of the
+//   transfer. Nothing syncs it meanwhile, so the preallocated size never
+//   reaches the directory entry.
+//
+// return false if the volume has not enough free space
 
-bool FtpServer::processCommand( char * command, char * parameters )
+bool FtpServer::filePrealloc( uint32_t size )
 {
-  fast_blink = TRUE;
+  if( size == 0 )
+    return true;
+  bool ok = f_lseek( & file, size ) == FR_OK && f_tell( & file ) == size;
+  f_lseek( & file, 0 );
+  if( ! ok )
+    f_truncate( & file );
+  DEBUG_PRINT( "Preallocation of %U bytes %s\r\n", size, ok ? "done" : "failed" );
+  return ok;
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //      ACCESS CONTROL COMMANDS      //
-  //                                   //
-  ///////////////////////////////////////
+// Close a file received by STOR, on every path after filePrealloc()
+//   The clusters beyond the data written are freed first, so that their
+//   former content can't be read by RETR
+//
+// return the FatFs result of truncating
 
-  //
-  //  QUIT
-  //
-  if( ! strcmp( command, "QUIT" ))
-    return FALSE;
-  //
-  //  PWD - Print Directory
-  //
-  else if( ! strcmp( command, "PWD" ) ||
-           ( ! strcmp( command, "CWD" ) && ! strcmp( parameters, "." )))  // 'CWD .' is the same as PWD command
+FRESULT FtpServer::fileClosePrealloc()
+{
+  FRESULT fr = FR_OK;
+
+  if( f_tell( & file ) < f_size( & file ))
+    fr = f_truncate( & file );
+  f_close( & file );
+  return fr;
+}
+
+// Move file pointer of the file just open to the position given by REST
+//
+// A cluster link map table of the file is built first, so the position
+//   (and any later one) is found in the table instead of following the
+//   cluster chain in the FAT. If the file is too fragmented for the table,
+//   f_lseek() walks the chain as usual.
+// When receiving a file, data after the position are dropped.
+//
+// return false if the position is invalid
+
+bool FtpServer::fileRestart()
+{
+  uint32_t pos = restPos;
+  bool ok;
+
+  restPos = 0;
+  seekPos = pos;
+  timeSeek = 0;
+  seekFrags = 0;
+  if( pos == 0 )
+    return true;
+  systime_t t = chVTGetSystemTimeX();
+  if( fastSeek )
   {
-    sendBegin( "257 \"" );
-    sendCat( cwdName );
-    sendCatWrite( "\" is your current directory" );
+    clmt[ 0 ] = FTP_CLMT_SIZE;
+    file.cltbl = clmt;
+    if( f_lseek( & file, CREATE_LINKMAP ) == FR_OK )
+      seekFrags = ( clmt[ 0 ] - 1 ) / 2;
+    else
+      file.cltbl = NULL;
   }
-  //
-  //  CWD - Change Working Directory
-  //
-  else if( ! strcmp( command, "CWD" ))
+  ok = pos <= f_size( & file ) && f_lseek( & file, pos ) == FR_OK;
+  if( ok && ( file.flag & FA_WRITE ))
   {
-    if( strlen( parameters ) == 0 )
-      sendWrite( "501 No directory name" );
-    else if( makePath( path ))
-      if( fs_exists( path ))
-      {
-        strcpy( cwdName, path );
-        sendWrite( "250 Directory successfully changed." );
-      }
-      else
-        sendWrite( "550 Failed to change directory." );
+    // In fast seek mode the file can't be expanded
+    file.cltbl = NULL;
+    ok = f_truncate( & file ) == FR_OK;
   }
-  //
-  //  CDUP - Change to Parent Directory
-  //
-  else if( ! strcmp( command, "CDUP" ))
+  timeSeek = chVTGetSystemTimeX() - t;
+  if( ! ok )
   {
-    bool ok = false;
-
-    if( strlen( cwdName ) > 1 )  // do nothing if cwdName is root
-    {
-      // if cwdName ends with '/', remove it (must not append)
-      if( cwdName[ strlen( cwdName ) - 1 ] == '/' )
-        cwdName[ strlen( cwdName ) - 1 ] = 0;
-      // search last '/'
-      char * pSep = strrchr( cwdName, '/' );
-      ok = pSep > cwdName;
-      // if found, ends the string on its position
-      if( ok )
-      {
-        * pSep = 0;
-        ok = fs_exists( cwdName );
-      }
-    }
-    // if an error appends, move to root
-    if( ! ok )
-      strcpy( cwdName, "/" );
-    sendBegin( "200 Ok. Current directory is " );
-    sendCatWrite( cwdName );
+    file.cltbl = NULL;
+    SEND_CONST( "554 Invalid REST parameter" );
   }
+  return ok;
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //    TRANSFER PARAMETER COMMANDS    //
-  //                                   //
-  ///////////////////////////////////////
+// Add to the response a line giving the restart position
+//   and the time needed to reach it
 
-  //
-  //  MODE - Transfer Mode
-  //
-  else if( ! strcmp( command, "MODE" ))
+void FtpServer::sendCatRestart()
+{
+  if( seekPos == 0 )
+    return;
+  sendCat( "150-Restarting at " );
+  sendCatNum( seekPos );
+  sendCat( ", seek in " );
+  sendCatNum( ST2MS( timeSeek ));
+  sendCat( " ms" );
+  if( seekFrags > 0 )
   {
-    if( ! strcmp( parameters, "S" ))
-      sendWrite( "200 S Ok" );
-    // else if( ! strcmp( parameters, "B" ))
-    //  sendWrite( "200 B Ok" );
-    else
-      sendWrite( "504 Only S(tream) is suported" );
+    sendCat( " (" );
+    sendCatNum( seekFrags );
+    sendCat( " fragments)" );
   }
-  //
-  //  STRU - File Structure
-  //
-  else if( ! strcmp( command, "STRU" ))
+  sendCat( "\r\n" );
+}
+
+// Size of chunks read from or written to the open file
+//
+// If not set by SITE BUFSIZE, it is the size of a cluster, up to the size
+//   of the file buffers. As chunks start on sector boundaries, FatFs
+//   transfers them directly between the SD card and the file buffer
+//   with one multiple block command.
+
+uint16_t FtpServer::fileChunkSize()
+{
+  if( fileBufSize > 0 )
+    return fileBufSize;
+  uint32_t clusterSize = (uint32_t) file.fs->csize * _MAX_SS;
+  return clusterSize < FTP_FILE_BUF_SIZE ? clusterSize : FTP_FILE_BUF_SIZE;
+}
+
+// Send the reply matching the result of a FatFs function
+
+void FtpServer::sendFileError( FRESULT fr, const char * name )
+{
+  switch( fr )
   {
-    if( ! strcmp( parameters, "F" ))
-      sendWrite( "200 F Ok" );
-    else
-      sendWrite( "504 Only F(ile) is suported" );
+    case FR_NO_FILE:
+    case FR_NO_PATH:
+      sendBegin( "550 " );
+      sendCat( name );
+      sendCatWrite( " not found" );
+      break;
+    case FR_EXIST:
+      sendBegin( "553 " );
+      sendCat( name );
+      sendCatWrite( " already exists" );
+      break;
+    case FR_INVALID_NAME:
+      sendBegin( "553 Invalid name " );
+      sendCatWrite( name );
+      break;
+    case FR_DENIED:
+    case FR_WRITE_PROTECTED:
+      sendBegin( "550 Access denied to " );
+      sendCatWrite( name );
+      break;
+    case FR_LOCKED:
+    case FR_TOO_MANY_OPEN_FILES:
+    case FR_TIMEOUT:
+      sendBegin( "450 " );
+      sendCat( name );
+      sendCatWrite( " is busy" );
+      break;
+    default:
+      sendBegin( "451 File system error " );
+      sendCatNum( fr );
+      sendWrite();
   }
-  //
-  //  TYPE - Data Type
-  //
-  else if( ! strcmp( command, "TYPE" ))
+}
+
+// Look for the file in the hot file cache before opening it
+//   Its date, time and size are taken from the directory cache, so
+//   a hit costs no access to FatFs nor to the SD card
+//
+// return index of slot in cache, or -1 if not found
+
+int8_t FtpServer::hotFileFind( char * path )
+{
+  timeFile = 0;
+  fileOps = 0;
+  if( restPos > 0 || dircacheStat( path, & finfo ) != FR_OK ||
+      finfo.fsize > FTP_HOT_FILE_SIZE )
+    return -1;
+  return ftp_hot_find( path, & finfo );
+}
+
+// Load the file in the hot file cache if it is small enough
+//   file must be open for reading. It is closed when loaded
+//
+// return index of slot in cache, or -1 if the file must be read from SD card
+
+int8_t FtpServer::hotFileLoad( char * path )
+{
+  int8_t    slot;
+  UINT      nb;
+  bool      ok;
+  systime_t t;
+
+  if( restPos > 0 || f_size( & file ) > FTP_HOT_FILE_SIZE ||
+      dircacheStat( path, & finfo ) != FR_OK || finfo.fsize != f_size( & file ) ||
+      ( slot = ftp_hot_reserve( path, & finfo )) < 0 )
+    return -1;
+  t = chVTGetSystemTimeX();
+  ok = fileRead( ftp_hot_data( slot ), finfo.fsize, & nb ) == FR_OK &&
+       nb == finfo.fsize;
+  timeFile = chVTGetSystemTimeX() - t;
+  fileOps = 1;
+  ftp_hot_loaded( slot, ok );
+  if( ! ok )
   {
-    if( ! strcmp( parameters, "A" ))
-      sendWrite( "200 TYPE is now ASCII" );
-    else if( ! strcmp( parameters, "I" ))
-      sendWrite( "200 TYPE is now 8-bit binary" );
+    f_lseek( & file, 0 );
+    return -1;
+  }
+  f_close( & file );
+  return slot;
+}
+
+// Send a file from the hot file cache, then release it
+
+void FtpServer::hotFileSend( int8_t slot )
+{
+  systime_t t;
+
+  if( dataConnect())
+  {
+    DEBUG_PRINT( "Sending %s from cache\r\n", parameters );
+    sendBegin( "150-Connected to port " );
+    sendCatNum( dataPort );
+    sendCat( "\r\n150 " );
+    sendCatNum( finfo.fsize );
+    sendCat( fileOps == 0 ? " bytes to download from RAM" : " bytes to download" );
+    // The transfer is short: send this reply with the 226 one
+    sendDefer();
+    timeBeginTrans = chVTGetSystemTimeX();
+    bytesTransfered = 0;
+    timeNet = 0;
+    storStalls = 0;
+    timeShape = 0;
+    transferSize = finfo.fsize;
+    chunkSize = finfo.fsize;
+    t = chVTGetSystemTimeX();
+    // The whole file is given to lwIP at once
+    if( finfo.fsize == 0 || dataSendRef( 0, ftp_hot_data( slot ), finfo.fsize ))
+      bytesTransfered = finfo.fsize;
+    dataWaitAll();
+    timeNet += chVTGetSystemTimeX() - t;
+    closeTransfer();
+    dataClose();
+  }
+  ftp_hot_release( slot );
+}
+
+// =========================================================
+//
+//                   Directory listings
+//
+// =========================================================
+
+// Entries are gathered in the file buffers and sent by segments of
+//   TCP_MSS bytes, without copy.
+// The 150 reply is deferred: if the listing fits in one segment,
+//   it is sent with the 226 reply.
+
+void FtpServer::listBegin()
+{
+  sendBegin( "150 Accepted data connection" );
+  sendDefer();
+  timeBeginTrans = chVTGetSystemTimeX();
+  bytesTransfered = 0;
+  listBuf = 0;
+  listLen = 0;
+  listEntries = 0;
+  listWrites = 0;
+}
+
+void FtpServer::listCat( const char * s )
+{
+  char * p = fbuf[ listBuf ];
+
+  while( * s != 0 && listLen < FTP_FILE_BUF_SIZE )
+    p[ listLen ++ ] = * s ++;
+}
+
+// Called at the end of each entry. Send a segment if the buffer holds enough
+//
+// return false if the data connection is broken
+
+bool FtpServer::listEntry()
+{
+  listEntries ++;
+  return listLen < TCP_MSS || listSend( TCP_MSS );
+}
+
+// Send the first nb bytes of the buffer, and move the remaining ones
+//   to the next buffer
+
+bool FtpServer::listSend( uint16_t nb )
+{
+  uint8_t next = ( listBuf + 1 ) % fileBufNbr;
+
+  sendFlush();
+  if( ! dataSendBuf( listBuf, nb ) || ! dataWaitBuf( next ))
+    return false;
+  memmove( fbuf[ next ], fbuf[ listBuf ] + nb, listLen - nb );
+  listLen -= nb;
+  listBuf = next;
+  listWrites ++;
+  bytesTransfered += nb;
+  return true;
+}
+
+// Send the end of the listing and begin the 226 reply with statistics
+//
+// return false if the transfer has been aborted (426 reply sent)
+
+bool FtpServer::listEnd()
+{
+  uint32_t deltaT;
+
+  if( ! ( listLen == 0 || listSend( listLen )) || ! dataWaitAll())
+  {
+    SEND_CONST( "426 Connection closed; transfer aborted" );
+    return false;
+  }
+  deltaT = (uint32_t) ( chVTGetSystemTimeX() - timeBeginTrans );
+  sendBegin( "226-" );
+  sendCatNum( listEntries );
+  sendCat( " entries in " );
+  sendCatNum( ST2MS( deltaT ));
+  sendCat( " ms" );
+  if( deltaT > 0 )
+  {
+    sendCat( ", " );
+    sendCatNum( listEntries * CH_CFG_ST_FREQUENCY / deltaT );
+    sendCat( " entries/s" );
+  }
+  if( listWrites > 0 )
+  {
+    sendCat( ", " );
+    sendCatNum( bytesTransfered / listWrites );
+    sendCat( " bytes per segment" );
+  }
+  sendCat( "\r\n" );
+  return true;
+}
+
+// =========================================================
+//
+//                   Process a command
+//
+// =========================================================
+
+// Pack the name of a command in 32 bits, first letter in most significant byte
+//   Numerical order of keys is alphabetical order of names
+
+#define FTP_CMD( a, b, c, d ) ((uint32_t) (a) << 24 | (uint32_t) (b) << 16 | \
+                               (uint32_t) (c) << 8 | (uint32_t) (d))
+
+// Commands and their handlers
+//   Must be sorted by name for the binary search of findCommand()
+
+const FtpServer::cmd_stru FtpServer::commands[] =
+{
+  { FTP_CMD( 'A', 'B', 'O', 'R' ), & FtpServer::cmdABOR },
+  { FTP_CMD( 'A', 'L', 'L', 'O' ), & FtpServer::cmdALLO },
+  { FTP_CMD( 'C', 'D', 'U', 'P' ), & FtpServer::cmdCDUP },
+  { FTP_CMD( 'C', 'W', 'D',  0  ), & FtpServer::cmdCWD  },
+  { FTP_CMD( 'D', 'E', 'L', 'E' ), & FtpServer::cmdDELE },
+  { FTP_CMD( 'F', 'E', 'A', 'T' ), & FtpServer::cmdFEAT },
+  { FTP_CMD( 'L', 'I', 'S', 'T' ), & FtpServer::cmdLIST },
+  { FTP_CMD( 'M', 'D', 'T', 'M' ), & FtpServer::cmdMDTM },
+  { FTP_CMD( 'M', 'K', 'D',  0  ), & FtpServer::cmdMKD  },
+  { FTP_CMD( 'M', 'L', 'S', 'D' ), & FtpServer::cmdMLSD },
+  { FTP_CMD( 'M', 'O', 'D', 'E' ), & FtpServer::cmdMODE },
+  { FTP_CMD( 'N', 'L', 'S', 'T' ), & FtpServer::cmdLIST },
+  { FTP_CMD( 'N', 'O', 'O', 'P' ), & FtpServer::cmdNOOP },
+  { FTP_CMD( 'P', 'A', 'S', 'V' ), & FtpServer::cmdPASV },
+  { FTP_CMD( 'P', 'O', 'R', 'T' ), & FtpServer::cmdPORT },
+  { FTP_CMD( 'P', 'W', 'D',  0  ), & FtpServer::cmdPWD  },
+  { FTP_CMD( 'Q', 'U', 'I', 'T' ), & FtpServer::cmdQUIT },
+  { FTP_CMD( 'R', 'E', 'S', 'T' ), & FtpServer::cmdREST },
+  { FTP_CMD( 'R', 'E', 'T', 'R' ), & FtpServer::cmdRETR },
+  { FTP_CMD( 'R', 'M', 'D',  0  ), & FtpServer::cmdRMD  },
+  { FTP_CMD( 'R', 'N', 'F', 'R' ), & FtpServer::cmdRNFR },
+  { FTP_CMD( 'R', 'N', 'T', 'O' ), & FtpServer::cmdRNTO },
+  { FTP_CMD( 'S', 'I', 'T', 'E' ), & FtpServer::cmdSITE },
+  { FTP_CMD( 'S', 'I', 'Z', 'E' ), & FtpServer::cmdSIZE },
+  { FTP_CMD( 'S', 'T', 'A', 'T' ), & FtpServer::cmdSTAT },
+  { FTP_CMD( 'S', 'T', 'O', 'R' ), & FtpServer::cmdSTOR },
+  { FTP_CMD( 'S', 'T', 'R', 'U' ), & FtpServer::cmdSTRU },
+//{ FTP_CMD( 'S', 'Y', 'S', 'T' ), & FtpServer::cmdSYST },
+  { FTP_CMD( 'T', 'Y', 'P', 'E' ), & FtpServer::cmdTYPE }
+};
+
+#define FTP_NBR_COMMANDS ( sizeof( FtpServer::commands ) / sizeof( FtpServer::cmd_stru ))
+
+// Return index of command in table commands[], or -1 if unknown
+//   readCommand() has converted the name to upper case
+
+int8_t FtpServer::findCommand( const char * cmd )
+{
+  uint32_t key = 0;
+  int8_t   lo = 0, hi = FTP_NBR_COMMANDS - 1, mid;
+
+  for( uint8_t i = 0; i < 4; i ++ )
+  {
+    key <<= 8;
+    if( * cmd != 0 )
+      key |= (uint8_t) * cmd ++;
+  }
+  while( lo <= hi )
+  {
+    mid = ( lo + hi ) / 2;
+    if( commands[ mid ].key == key )
+      return mid;
+    if( commands[ mid ].key < key )
+      lo = mid + 1;
     else
-      sendWrite( "504 Unknow TYPE" );
+      hi = mid - 1;
   }
-  //
-  //  PASV - Passive Connection management
-  //
-  else if( ! strcmp( command, "PASV" ))
+  return -1;
+}
+
+#if FTP_BENCH
+
+// Order in which commands were compared by the former chain of strcmp()
+
+static const char * const legacyCommands[] =
+{
+  "QUIT", "PWD",  "CWD",  "CDUP", "MODE", "STRU", "TYPE", "PASV", "PORT",
+  "LIST", "NLST", "MLSD", "DELE", "REST", "ALLO", "NOOP", "RETR", "STOR",
+  "MKD",  "RMD",  "RNFR", "RNTO", "FEAT", "MDTM", "SIZE", "SITE", "STAT"
+};
+
+#define FTP_NBR_LEGACY   ( sizeof( legacyCommands ) / sizeof( char * ))
+#define FTP_BENCH_LOOPS  1000
+
+static int8_t legacyFind( const char * cmd )
+{
+  for( uint8_t i = 0; i < FTP_NBR_LEGACY; i ++ )
+    if( ! strcmp( cmd, legacyCommands[ i ] ))
+      return i;
+  return -1;
+}
+
+// Measure with the cycle counter the cost of finding each command,
+//   with the former chain of strcmp() and with the table
+
+void FtpServer::siteBench()
+{
+  volatile int8_t r;
+  rtcnt_t  t;
+  uint32_t legacySum = 0, legacyMax = 0, tableSum = 0, tableMax = 0;
+  uint16_t n;
+
+  for( uint8_t i = 0; i < FTP_NBR_LEGACY; i ++ )
   {
-    if( listenDataConn())
+    t = chSysGetRealtimeCounterX();
+    for( n = 0; n < FTP_BENCH_LOOPS; n ++ )
+      r = legacyFind( legacyCommands[ i ] );
+    t = ( chSysGetRealtimeCounterX() - t ) / FTP_BENCH_LOOPS;
+    legacySum += t;
+    if( t > legacyMax )
+      legacyMax = t;
+    t = chSysGetRealtimeCounterX();
+    for( n = 0; n < FTP_BENCH_LOOPS; n ++ )
+      r = findCommand( legacyCommands[ i ] );
+    t = ( chSysGetRealtimeCounterX() - t ) / FTP_BENCH_LOOPS;
+    tableSum += t;
+    if( t > tableMax )
+      tableMax = t;
+  }
+  (void) r;
+  sendBegin( "211-CPU cycles to find a command, average and worst of " );
+  sendCatNum( FTP_NBR_LEGACY );
+  sendCat( " commands\r\n211-strcmp chain: " );
+  sendCatNum( legacySum / FTP_NBR_LEGACY );
+  sendCat( ", " );
+  sendCatNum( legacyMax );
+  sendCat( "\r\n211 table: " );
+  sendCatNum( tableSum / FTP_NBR_LEGACY );
+  sendCat( ", " );
+  sendCatNum( tableMax );
+  sendWrite();
+}
+
+#endif
+
+bool FtpServer::processCommand( char * command, char * parameters )
+{
+  int8_t i;
+
+  fast_blink = TRUE;
+  i = findCommand( command );
+  if( i < 0 )
+  {
+    SEND_CONST( "500 Unknow command" );
+    return TRUE;
+  }
+  return ( this->* commands[ i ].handler )();
+}
+
+// =========================================================
+//
+//                   Commands
+//
+// =========================================================
+
+///////////////////////////////////////
+//                                   //
+//      ACCESS CONTROL COMMANDS      //
+//                                   //
+///////////////////////////////////////
+
+//  QUIT
+
+bool FtpServer::cmdQUIT()
+{
+  return FALSE;
+}
+
+//  PWD - Print Directory
+
+bool FtpServer::cmdPWD()
+{
+  sendBegin( "257 \"" );
+  sendCat( cwdName );
+  sendCatWrite( "\" is your current directory" );
+  return TRUE;
+}
+
+//  CWD - Change Working Directory
+
+bool FtpServer::cmdCWD()
+{
+  if( ! strcmp( parameters, "." ))  // 'CWD .' is the same as PWD command
+    return cmdPWD();
+  if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No directory name" );
+  else if( makePath( path ))
+    if( fs_exists( path ))
     {
-      dataClose();
-      sendBegin( "227 Entering Passive Mode (" );
-      sendCat( i2str( ip4_addr1( & ipserver ))); sendCat( "," );
-      sendCat( i2str( ip4_addr2( & ipserver ))); sendCat( "," );
-      sendCat( i2str( ip4_addr3( & ipserver ))); sendCat( "," );
-      sendCat( i2str( ip4_addr4( & ipserver ))); sendCat( "," );
-      sendCat( i2str( dataPort >> 8 )); sendCat( "," );
-      sendCat( i2str( dataPort & 255 )); sendCatWrite( ")." );
-      DEBUG_PRINT( "Data port set to %U\r\n", dataPort );
-      dataConnMode = PASSIVE;
+      strcpy( cwdName, path );
+      SEND_CONST( "250 Directory successfully changed." );
     }
     else
+      SEND_CONST( "550 Failed to change directory." );
+  return TRUE;
+}
+
+//  CDUP - Change to Parent Directory
+
+bool FtpServer::cmdCDUP()
+{
+  bool ok = false;
+
+  if( strlen( cwdName ) > 1 )  // do nothing if cwdName is root
+  {
+    // if cwdName ends with '/', remove it (must not append)
+    if( cwdName[ strlen( cwdName ) - 1 ] == '/' )
+      cwdName[ strlen( cwdName ) - 1 ] = 0;
+    // search last '/'
+    char * pSep = strrchr( cwdName, '/' );
+    ok = pSep > cwdName;
+    // if found, ends the string on its position
+    if( ok )
     {
-      sendWrite( "425 Can't set connection management to passive" );
-      dataConnMode = NOTSET;
+      * pSep = 0;
+      ok = fs_exists( cwdName );
     }
   }
-  //
-  //  PORT - Data Port
-  //
-  else if( ! strcmp( command, "PORT" ))
+  // if an error appends, move to root
+  if( ! ok )
+    strcpy( cwdName, "/" );
+  sendBegin( "200 Ok. Current directory is " );
+  sendCatWrite( cwdName );
+  return TRUE;
+}
+
+///////////////////////////////////////
+//                                   //
+//    TRANSFER PARAMETER COMMANDS    //
+//                                   //
+///////////////////////////////////////
+
+//  MODE - Transfer Mode
+
+bool FtpServer::cmdMODE()
+{
+  if( ! strcmp( parameters, "S" ))
+    SEND_CONST( "200 S Ok" );
+  // else if( ! strcmp( parameters, "B" ))
+  //  sendWrite( "200 B Ok" );
+  else
+    SEND_CONST( "504 Only S(tream) is suported" );
+  return TRUE;
+}
+
+//  STRU - File Structure
+
+bool FtpServer::cmdSTRU()
+{
+  if( ! strcmp( parameters, "F" ))
+    SEND_CONST( "200 F Ok" );
+  else
+    SEND_CONST( "504 Only F(ile) is suported" );
+  return TRUE;
+}
+
+//  TYPE - Data Type
+
+bool FtpServer::cmdTYPE()
+{
+  if( ! strcmp( parameters, "A" ))
+    SEND_CONST( "200 TYPE is now ASCII" );
+  else if( ! strcmp( parameters, "I" ))
+    SEND_CONST( "200 TYPE is now 8-bit binary" );
+  else
+    SEND_CONST( "504 Unknow TYPE" );
+  return TRUE;
+}
+
+//  PASV - Passive Connection management
+
+bool FtpServer::cmdPASV()
+{
+  uint16_t port;
+
+  dataClose();
+  port = ftp_pasv_open( sesNum, & ippeer );
+  if( port > 0 )
   {
-    uint8_t ip[4];
-    uint8_t i;
-    dataClose();
-    // get IP of data client
-    char * p = NULL;
-    if( strlen( parameters ) > 0 )
+    sendBegin( "227 Entering Passive Mode (" );
+    sendCatIp( & ipserver, ',' );
+    sendCat( "," );
+    sendCatNum( port >> 8 );
+    sendCat( "," );
+    sendCatNum( port & 255 );
+    sendCatWrite( ")." );
+    DEBUG_PRINT( "Data port set to %U\r\n", port );
+    dataConnMode = PASSIVE;
+  }
+  else
+  {
+    SEND_CONST( "425 Can't set connection management to passive" );
+    dataConnMode = NOTSET;
+  }
+  return TRUE;
+}
+
+//  PORT - Data Port
+
+bool FtpServer::cmdPORT()
+{
+  uint8_t ip[4];
+  uint8_t i;
+  dataClose();
+  ftp_pasv_close( sesNum );
+  // get IP of data client
+  char * p = NULL;
+  if( strlen( parameters ) > 0 )
+  {
+    p = parameters - 1;
+    for( i = 0; i < 4 && p != NULL; i ++ )
     {
-      p = parameters - 1;
-      for( i = 0; i < 4 && p != NULL; i ++ )
-      {
-        ip[ i ] = atoi( ++ p );
-        p = strchr( p, ',' );
-      }
-      // get port of data client
-      if( i == 4 && p != NULL )
-      {
-        dataPort = 256 * atoi( ++ p );
-        p = strchr( p, ',' );
-        if( p != NULL )
-          dataPort += atoi( ++ p );
-      }
+      ip[ i ] = atoi( ++ p );
+      p = strchr( p, ',' );
     }
-    if( p == NULL )
+    // get port of data client
+    if( i == 4 && p != NULL )
     {
-      sendWrite( "501 Can't interpret parameters" );
-      dataConnMode = NOTSET;
-    }
-    else
-    {
-      IP4_ADDR( & ipclient, ip[0], ip[1], ip[2], ip[3] );
-      sendWrite( "200 PORT command successful" );
-      DEBUG_PRINT( "Data IP set to %u:%u:%u:%u\r\n", ip[0], ip[1], ip[2], ip[3] );
-      DEBUG_PRINT( "Data port set to %U\r\n", dataPort );
-      dataConnMode = ACTIVE;
+      dataPort = 256 * atoi( ++ p );
+      p = strchr( p, ',' );
+      if( p != NULL )
+        dataPort += atoi( ++ p );
     }
   }
+  if( p == NULL )
+  {
+    SEND_CONST( "501 Can't interpret parameters" );
+    dataConnMode = NOTSET;
+  }
+  else
+  {
+    IP4_ADDR( & ipclient, ip[0], ip[1], ip[2], ip[3] );
+    SEND_CONST( "200 PORT command successful" );
+    DEBUG_PRINT( "Data IP set to %u:%u:%u:%u\r\n", ip[0], ip[1], ip[2], ip[3] );
+    DEBUG_PRINT( "Data port set to %U\r\n", dataPort );
+    dataConnMode = ACTIVE;
+  }
+  return TRUE;
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //        FTP SERVICE COMMANDS       //
-  //                                   //
-  ///////////////////////////////////////
+///////////////////////////////////////
+//                                   //
+//        FTP SERVICE COMMANDS       //
+//                                   //
+///////////////////////////////////////
 
-  //
-  //  LIST and NLST - List
-  //
-  else if( ! strcmp( command, "LIST" ) || ! strcmp( command, "NLST" ))
-  {
-    uint16_t nm = 0;
-    DIR dir;
+//  LIST and NLST - List
 
-    if( ! fs_opendir( & dir, cwdName ))
-    {
-      sendBegin( "550 Can't open directory " );
-      sendCatWrite( cwdName );
-    }
-    else if( dataConnect())
+bool FtpServer::cmdLIST()
+{
+  DIR      dir;
+  int8_t   slot = dircacheOpen( cwdName );
+  uint16_t pos = 0;
+
+  if( slot < 0 && ! fs_opendir( & dir, cwdName ))
+  {
+    sendBegin( "550 Can't open directory " );
+    sendCatWrite( cwdName );
+  }
+  else if( dataConnect())
+  {
+    listBegin();
+    while( dirNext( & dir, slot, & pos ))
     {
-      sendWrite( "150 Accepted data connection" );
-      for( ; ; )
+      if( finfo.fname[0] == '.' )
+        continue;
+      if( ! strcmp( command, "LIST" ))
       {
-        if( f_readdir( & dir, & finfo ) != FR_OK ||
-            finfo.fname[0] == 0 )
-          break;
-        if( finfo.fname[0] == '.' )
-          continue;
-        if( ! strcmp( command, "LIST" ))
+        if( finfo.fattrib & AM_DIR )
+          listCat( "+/" );
+        else
         {
-          if( finfo.fattrib & AM_DIR )
-            strcpy( buf, "+/" );
-          else
-          {
-            strcpy( buf, "+r,s" );
-            strcat( buf, i2str( finfo.fsize ));
-          }
-          strcat( buf, ",\t" );
-          strcat( buf, lfn[0] == 0 ? finfo.fname : lfn );
+          listCat( "+r,s" );
+          listCat( i2str( finfo.fsize ));
         }
-        else
-          strcpy( buf, lfn[0] == 0 ? finfo.fname : lfn );
-        strcat( buf, "\r\n" );
-        dataWrite( buf );
-        nm ++;
+        listCat( ",\t" );
       }
-      sendWrite( "226 Directory send OK." );
-      dataClose();
+      listCat( lfn[0] == 0 ? finfo.fname : lfn );
+      listCat( "\r\n" );
+      if( ! listEntry())
+        break;
     }
+    if( listEnd())
+      sendCatWrite( "226 Directory send OK." );
+    dataClose();
   }
-  //
-  //  MLSD - Listing for Machine Processing (see RFC 3659)
-  //
-  else if( ! strcmp( command, "MLSD" ))
-  {
-    DIR dir;
-    uint16_t nm = 0;
+  if( slot >= 0 )
+    dircacheClose( slot );
+  return TRUE;
+}
 
-    if( ! fs_opendir( & dir, cwdName ))
-    {
-      sendBegin( "550 Can't open directory " );
-      sendCatWrite( parameters );
-    }
-    else if( dataConnect())
+//  MLSD - Listing for Machine Processing (see RFC 3659)
+
+bool FtpServer::cmdMLSD()
+{
+  DIR      dir;
+  int8_t   slot = dircacheOpen( cwdName );
+  uint16_t pos = 0;
+
+  if( slot < 0 && ! fs_opendir( & dir, cwdName ))
+  {
+    sendBegin( "550 Can't open directory " );
+    sendCatWrite( parameters );
+  }
+  else if( dataConnect())
+  {
+    listBegin();
+    while( dirNext( & dir, slot, & pos ))
     {
-      sendWrite( "150 Accepted data connection" );
-      for( ; ; )
+      if( finfo.fname[0] == '.' )
+        continue;
+      listCat( "Type=" );
+      listCat( finfo.fattrib & AM_DIR ? "dir" : "file" );
+      listCat( ";Size=" );
+      listCat( i2str( finfo.fsize ));
+      if( finfo.fdate != 0 )
       {
-        if( f_readdir( & dir, & finfo ) != FR_OK ||
-            finfo.fname[0] == 0 )
-          break;
-        if( finfo.fname[0] == '.' )
-          continue;
-        strcpy( buf, "Type=" );
-        strcat( buf, finfo.fattrib & AM_DIR ? "dir" : "file" );
-        strcat( buf, ";Size=" );
-        strcat( buf, i2str( finfo.fsize ));
-        if( finfo.fdate != 0 )
-        {
-          strcat( buf, ";Modify=" );
-          strcat( buf, makeDateTimeStr( finfo.fdate, finfo.ftime ));
-        }
-        strcat( buf, "; " );
-        strcat( buf, lfn[0] == 0 ? finfo.fname : lfn );
-        strcat( buf, "\r\n" );
-        dataWrite( buf );
-        nm ++;
+        listCat( ";Modify=" );
+        listCat( makeDateTimeStr( finfo.fdate, finfo.ftime ));
       }
-      sendBegin( "226-options: -a -l\r\n" );
+      listCat( "; " );
+      listCat( lfn[0] == 0 ? finfo.fname : lfn );
+      listCat( "\r\n" );
+      if( ! listEntry())
+        break;
+    }
+    if( listEnd())
+    {
+      sendCat( "226-options: -a -l\r\n" );
       sendCat( "226 " );
-      sendCat( i2str( nm ));
+      sendCatNum( listEntries );
       sendCatWrite( " matches total" );
-      dataClose();
     }
+    dataClose();
   }
-  //
-  //  DELE - Delete a File
-  //
-  else if( ! strcmp( command, "DELE" ))
+  if( slot >= 0 )
+    dircacheClose( slot );
+  return TRUE;
+}
+
+//  DELE - Delete a File
+
+bool FtpServer::cmdDELE()
+{
+  FRESULT fr;
+
+  if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No file name" );
+  else if( makePath( path ))
   {
-    if( strlen( parameters ) == 0 )
-      sendWrite( "501 No file name" );
-    else if( makePath( path ))
+    // sd_logger may keep the file open
+    sdlogBegin( path );
+    fr = f_unlink( path );
+    sdlogEnd( path );
+    ftp_hot_invalidate( path );
+    dircacheInvalidate( path );
+    if( fr == FR_OK )
     {
-      if( ! fs_exists( path ))
-      {
-        sendBegin( "550 File " );
-        sendCat( parameters );
-        sendCatWrite( " not found" );
-      }
-      else
-      {
-        uint8_t ffs_result = f_unlink( path );
-        if( ffs_result == FR_OK )
-        {
-          sendBegin( "250 Deleted " );
-          sendCatWrite( parameters );
-        }
-        else
-        {
-          sendBegin( "450 Can't delete " );
-          sendCatWrite( parameters );
-        }
-      }
+      sendBegin( "250 Deleted " );
+      sendCatWrite( parameters );
     }
+    else
+      sendFileError( fr, parameters );
   }
-  //
-  //  NOOP
-  //
-  else if( ! strcmp( command, "NOOP" ))
+  return TRUE;
+}
+
+//  REST - Restart
+
+bool FtpServer::cmdREST()
+{
+  if( strlen( parameters ) == 0 || ! isdigit( parameters[ 0 ] ))
+    SEND_CONST( "501 Syntax error in parameters" );
+  else
   {
-    sendWrite( "200 Zzz..." );
+    restPos = strtoul( parameters, NULL, 10 );
+    sendBegin( "350 Restarting at " );
+    sendCatNum( restPos );
+    sendCatWrite( ". Send STORE or RETRIEVE" );
   }
-  //
-  //  RETR - Retrieve
-  //
-  else if( ! strcmp( command, "RETR" ))
+  return TRUE;
+}
+
+//  ALLO - Allocate
+
+bool FtpServer::cmdALLO()
+{
+  allocSize = strtoul( parameters, NULL, 10 );
+  if( allocSize > 0 )
+  {
+    sendBegin( "200 " );
+    sendCatNum( allocSize );
+    sendCatWrite( " bytes will be allocated to next file" );
+  }
+  else
+    SEND_CONST( "202 No storage allocation necessary" );
+  return TRUE;
+}
+
+//  NOOP
+
+bool FtpServer::cmdNOOP()
+{
+  SEND_CONST( "200 Zzz..." );
+  return TRUE;
+}
+
+//  ABOR - Abort
+//    During a transfer, ABOR is read by ctrlPoll()
+
+bool FtpServer::cmdABOR()
+{
+  SEND_CONST( "226 No transfer to abort" );
+  return TRUE;
+}
+
+//  RETR - Retrieve
+
+bool FtpServer::cmdRETR()
+{
+  int8_t  hot;
+  FRESULT fr;
+
+  if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No file name" );
+  else if( makePath( path ))
   {
-    if( strlen( parameters ) == 0 )
-      sendWrite( "501 No file name" );
-    else if( makePath( path ))
+    if(( hot = hotFileFind( path )) >= 0 )
+      hotFileSend( hot );
+    else if(( fr = f_open( & file, path, FA_READ )) != FR_OK )
+      sendFileError( fr, parameters );
+    else if(( hot = hotFileLoad( path )) >= 0 )
+      hotFileSend( hot );
+    else if( ! fileRestart())
+      f_close( & file );
+    else if( ! dataConnect())
+      f_close( & file );
+    else
     {
-      if( ! fs_exists( path ))
+      UINT      nb;
+      uint8_t   nbuf = 0;
+      systime_t t;
+
+      DEBUG_PRINT( "Sending %s\r\n", parameters );
+      sendBegin( "150-Connected to port " );
+      sendCatNum( dataPort );
+      sendCat( "\r\n" );
+      sendCatRestart();
+      sendCat( "150 " );
+      sendCatNum( f_size( & file ) - f_tell( & file ));
+      sendCatWrite( " bytes to download" );
+      timeBeginTrans = chVTGetSystemTimeX();
+      bytesTransfered = 0;
+      timeFile = 0;
+      timeNet = 0;
+      fileOps = 0;
+      storStalls = 0;
+      chunkSize = fileChunkSize();
+      ss[ num ].active = true;
+      ftp_bucket_init( & bucket, rateKB );
+      timeShape = 0;
+      transferSize = f_size( & file );
+      ctrlWatch( true );
+
+      // Buffers are used in turn: while lwIP sends one of them,
+      //   the next one is filled from the SD card
+      DEBUG_PRINT( "Start transfert\r\n" );
+      while( ctrlPoll())
       {
-        sendBegin( "550 File " );
-        sendCat( parameters );
-        sendCatWrite( " not found" );
-      }
-      else if( f_open( & file, path, FA_READ ) != FR_OK )
-      {
-        sendBegin( "450 Can't open " );
-        sendCatWrite( parameters );
+        t = chVTGetSystemTimeX();
+        if( ! dataWaitBuf( nbuf ))
+          break;
+        timeNet += chVTGetSystemTimeX() - t;
+        t = chVTGetSystemTimeX();
+        if( fileRead( fbuf[ nbuf ], chunkSize, & nb ) != FR_OK ||
+            nb == 0 )
+          break;
+        timeFile += chVTGetSystemTimeX() - t;
+        fileOps ++;
+        timeShape += ftp_rate_take( & bucket, nb );
+        t = chVTGetSystemTimeX();
+        if( ! dataSendBuf( nbuf, nb ))
+          break;
+        timeNet += chVTGetSystemTimeX() - t;
+        bytesTransfered += nb;
+        nbuf = ( nbuf + 1 ) % fileBufNbr;
+        DEBUG_PRINT( "Sent %u bytes\r", bytesTransfered );
+        fast_blink = TRUE;
       }
-      else if( dataConnect())
-      {
-        uint16_t nb;
-
-        DEBUG_PRINT( "Sending %s\r\n", parameters );
-        sendBegin( "150-Connected to port " );
-        sendCat( i2str( dataPort ));
-        sendCat( "\r\n150 " );
-        sendCat( i2str( f_size( & file )));
-        sendCatWrite( " bytes to download" );
-        timeBeginTrans = chVTGetSystemTimeX();
-        bytesTransfered = 0;
-
-        DEBUG_PRINT( "Start transfert\r\n" );
-        while( f_read( & file, buf, FTP_BUF_SIZE, (UINT *) & nb ) == FR_OK && nb > 0 )
-        {
-          netconn_write( dataconn, buf, nb, NETCONN_COPY );
-          bytesTransfered += nb;
-          DEBUG_PRINT( "Sent %u bytes\r", bytesTransfered );
-          fast_blink = TRUE;
-        }
-        DEBUG_PRINT( "\n" );
-        f_close( & file );
-        closeTransfer();
+      t = chVTGetSystemTimeX();
+      dataWaitAll();
+      timeNet += chVTGetSystemTimeX() - t;
+      ss[ num ].active = false;
+      ctrlWatch( false );
+      DEBUG_PRINT( "\n" );
+      f_close( & file );
+      // On ABOR, the data connection is closed before the reply
+      if( aborted )
         dataClose();
-      }
+      closeTransfer();
+      dataClose();
     }
   }
-  //
-  //  STOR - Store
-  //
-  else if( ! strcmp( command, "STOR" ))
+  return TRUE;
+}
+
+//  STOR - Store
+
+bool FtpServer::cmdSTOR()
+{
+  FRESULT fr;
+
+  if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No file name" );
+  else if( makePath( path ))
   {
-    if( strlen( parameters ) == 0 )
-      sendWrite( "501 No file name" );
-    else if( makePath( path ))
+    // Size given by ALLO must be available, SITE PREALLOC is only a hint
+    //   When restarting, the end of the file is kept
+    bool     allo = allocSize > 0;
+    uint32_t size = allo ? allocSize : allocHint;
+    allocSize = 0;
+    if( restPos > 0 )
+      size = 0;
+    ftp_hot_invalidate( path );
+    // sd_logger must leave the file alone until it is received
+    sdlogBegin( path );
+    // A restart needs an existing file at least restPos bytes long,
+    //   checked by fileRestart() before anything is written
+    if(( fr = f_open( & file, path, ( restPos > 0 ? FA_OPEN_EXISTING
+                                                  : FA_CREATE_ALWAYS )
+                                    | FA_WRITE )) != FR_OK )
+      sendFileError( fr, parameters );
+    else if( ! fileRestart())
+      f_close( & file );
+    else if( ! filePrealloc( size ) && allo )
+    {
+      f_close( & file );
+      f_unlink( path );
+      SEND_CONST( "452 Insufficient storage space" );
+    }
+    else if( ! dataConnect())
+      fileClosePrealloc();
+    else
     {
-      if( f_open( & file, path, FA_CREATE_ALWAYS | FA_WRITE ) != FR_OK )
+      struct   pbuf * rcvbuf = NULL;
+      int8_t   ferr;
+      systime_t t;
+
+      DEBUG_PRINT( "Receiving %s\r\n", parameters );
+      sendBegin( "" );
+      sendCatRestart();
+      sendCat( "150 Connected to port " );
+      sendCatNum( dataPort );
+      sendWrite();
+      timeBeginTrans = chVTGetSystemTimeX();
+      bytesTransfered = 0;
+      timeNet = 0;
+      chunkSize = fileChunkSize();
+      storBegin();
+      ss[ num ].active = true;
+      ftp_bucket_init( & bucket, rateKB );
+      timeShape = 0;
+      transferSize = 0;
+      ctrlWatch( true );
+      // Received pbufs are only queued to the ftp_storage thread,
+      //   so the receive window stays open while the SD card is busy
+      do
       {
-        sendBegin( "451 Can't open/create " );
-        sendCatWrite( parameters );
+        t = chVTGetSystemTimeX();
+        nerr = netconn_recv_tcp_pbuf( dataconn, & rcvbuf );
+        timeNet += chVTGetSystemTimeX() - t;
+        if( nerr != ERR_OK )
+          break;
+        uint16_t len = rcvbuf->tot_len;
+        bytesTransfered += len;
+        storPush( rcvbuf );
+        // Until the buckets are refilled, data stay in lwIP
+        timeShape += ftp_rate_take( & bucket, len );
+        DEBUG_PRINT( "Received %u bytes\r", bytesTransfered );
+        fast_blink = TRUE;
       }
-      else if( ! dataConnect())
-        f_close( & file );
-      else
+      while( ctrlPoll());
+      ferr = storEnd();
+      ss[ num ].active = false;
+      ctrlWatch( false );
+      // Free the clusters preallocated beyond the received data, even
+      //   after an error: the file ends with the last data written
+      fr = fileClosePrealloc();
+      if( ferr == 0 )
+        ferr = fr;
+      // A RETR may have loaded the file while it was received
+      ftp_hot_invalidate( path );
+      dircacheInvalidate( path );
+      DEBUG_PRINT( "\n" );
+      // When ctrlPoll() stopped the transfer, nerr is not the one of
+      //   the data connection. Nobody is left to reply to if the control
+      //   connection was closed
+      if( ! ctrlLost )
       {
-        struct   pbuf * rcvbuf = NULL;
-        void   * prcvbuf;
-        uint16_t buflen = 0;
-        uint16_t off = 0;
-        uint16_t copylen;
-        int8_t   ferr = 0;
-        UINT     nb;
-
-        DEBUG_PRINT( "Receiving %s\r\n", parameters );
-        sendBegin( "150 Connected to port " );
-        sendCatWrite( i2str( dataPort ));
-        timeBeginTrans = chVTGetSystemTimeX();
-        bytesTransfered = 0;
-        do
-        {
-          nerr = netconn_recv_tcp_pbuf( dataconn, & rcvbuf );
-          if( nerr != ERR_OK )
-            break;
-          prcvbuf = rcvbuf->payload;
-          buflen = rcvbuf->tot_len;
-          while( buflen > 0 )
-          {
-            if( buflen <= FTP_BUF_SIZE - off )
-              copylen = buflen;
-            else
-              copylen = FTP_BUF_SIZE - off;
-            buflen -= copylen;
-            memcpy( buf + off, prcvbuf, copylen );
-            prcvbuf += copylen;
-            off += copylen;
-            if( off == FTP_BUF_SIZE )
-            {
-              if( ferr == 0 )
-                ferr = f_write( & file, buf, FTP_BUF_SIZE, (UINT *) & nb );
-              off = 0;
-            }
-            bytesTransfered += copylen;
-          }
-          pbuf_free( rcvbuf );
-          DEBUG_PRINT( "Received %u bytes\r", bytesTransfered );
-          fast_blink = TRUE;
-        }
-        while( true ); // ferr == 0 );
-        if( off > 0 && ferr == 0 )
-          ferr = f_write( & file, buf, off, (UINT *) & nb );
-        f_close( & file );
-        DEBUG_PRINT( "\n" );
-        if( nerr != ERR_CLSD  )
+        if( nerr != ERR_CLSD && ! aborted )
         {
           sendBegin( "451 Requested action aborted: communication error " );
-          sendCatWrite( i2str( abs( nerr )));
+          sendCatNum( abs( nerr ));
+          sendWrite();
         }
         if( ferr != 0  )
         {
           sendBegin( "451 Requested action aborted: file error " );
-          sendCatWrite( i2str( abs( ferr )));
+          sendCatNum( abs( ferr ));
+          sendWrite();
         }
-        dataClose();
-        closeTransfer();
       }
+      dataClose();
+      if( ! ctrlLost )
+        closeTransfer();
     }
+    sdlogEnd( path );
   }
-  //
-  //  MKD - Make Directory
-  //
-  else if( ! strcmp( command, "MKD" ))
+  return TRUE;
+}
+
+//  MKD - Make Directory
+
+bool FtpServer::cmdMKD()
+{
+  FRESULT fr;
+
+  if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No directory name" );
+  else if( makePath( path ))
   {
-    if( strlen( parameters ) == 0 )
-      sendWrite( "501 No directory name" );
-    else if( makePath( path ))
+    DEBUG_PRINT(  "Creating directory %s\r\n", parameters );
+    fr = f_mkdir( path );
+    dircacheInvalidate( path );
+
+    RTCDateTime timespec;
+    struct tm stm;
+    rtcGetTime( & RTCD1, & timespec );
+    rtcConvertDateTimeToStructTm( & timespec, & stm, NULL );
+    DEBUG_PRINT( "Date/Time: %04u/%02u/%02u %02u:%02u:%02u\r\n",
+                 stm.tm_year + 1900, stm.tm_mon + 1, stm.tm_mday,
+                 stm.tm_hour, stm.tm_min, stm.tm_sec );
+
+    if( fr == FR_OK )
     {
-      if( fs_exists( path ))
-      {
-        sendBegin( "521 \"" );
-        sendCat( parameters );
-        sendCatWrite( "\" directory already exists" );
-      }
-      else
-      {
-        DEBUG_PRINT(  "Creating directory %s\r\n", parameters );
-        uint8_t ffs_result = f_mkdir( path );
+      sendBegin( "257 \"" );
+      sendCat( parameters );
+      sendCatWrite( "\" created" );
+    }
+    else if( fr == FR_EXIST )
+    {
+      sendBegin( "521 \"" );
+      sendCat( parameters );
+      sendCatWrite( "\" directory already exists" );
+    }
+    else
+      sendFileError( fr, parameters );
+  }
+  return TRUE;
+}
 
-        RTCDateTime timespec;
-        struct tm stm;
-        rtcGetTime( & RTCD1, & timespec );
-        rtcConvertDateTimeToStructTm( & timespec, & stm, NULL );
-        DEBUG_PRINT( "Date/Time: %04u/%02u/%02u %02u:%02u:%02u\r\n",
-                     stm.tm_year + 1900, stm.tm_mon + 1, stm.tm_mday,
-                     stm.tm_hour, stm.tm_min, stm.tm_sec );
+//  RMD - Remove a Directory
 
+bool FtpServer::cmdRMD()
+{
+  FRESULT fr;
 
-        if( ffs_result == FR_OK )
-        {
-          sendBegin( "257 \"" );
-          sendCat( parameters );
-          sendCatWrite( "\" created" );
-        }
-        else
-        {
-          sendBegin( "550 Can't create \"" );
-          sendCat( parameters );
-          sendCatWrite( "\"" );
-        }
-      }
+  if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No directory name" );
+  else if( makePath( path ))
+  {
+    DEBUG_PRINT(  "Deleting %s\r\n", path );
+    fr = f_unlink( path );
+    dircacheInvalidate( path );
+    if( fr == FR_OK )
+    {
+      sendBegin( "250 \"" );
+      sendCat( parameters );
+      sendCatWrite( "\" removed" );
     }
+    else
+      sendFileError( fr, parameters );
   }
-  //
-  //  RMD - Remove a Directory
-  //
-  else if( ! strcmp( command, "RMD" ))
+  return TRUE;
+}
+
+//  RNFR - Rename From
+
+bool FtpServer::cmdRNFR()
+{
+  cwdRNFR[ 0 ] = 0;
+  if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No file name" );
+  else if( makePath( cwdRNFR ))
   {
-    if( strlen( parameters ) == 0 )
-      sendWrite( "501 No directory name" );
-    else if( makePath( path ))
+    if( ! fs_exists( cwdRNFR ))
     {
-      DEBUG_PRINT(  "Deleting %s\r\n", path );
-      if( ! fs_exists( path ))
-      {
-        sendBegin( "550 Directory \"" );
-        sendCat( parameters );
-        sendCatWrite( "\" not found" );
-      }
-      else if( f_unlink( path ) == FR_OK)
-      {
-        sendBegin( "250 \"" );
-        sendCat( parameters );
-        sendCatWrite( "\" removed" );
-      }
-      else
-      {
-        sendBegin( "501 Can't delete \"" );
-        sendCat( parameters );
-        sendCatWrite( "\"" );
-      }
+      sendBegin( "550 File " );
+      sendCat( parameters );
+      sendCatWrite( " not found" );
+    }
+    else
+    {
+      DEBUG_PRINT( "Renaming %s\r\n", cwdRNFR );
+      SEND_CONST( "350 RNFR accepted - file exists, ready for destination" );
     }
   }
-  //
-  //  RNFR - Rename From
-  //
-  else if( ! strcmp( command, "RNFR" ))
+  return TRUE;
+}
+
+//  RNTO - Rename To
+
+bool FtpServer::cmdRNTO()
+{
+  FRESULT fr;
+
+  if( strlen( cwdRNFR ) == 0 )
+    SEND_CONST( "503 Need RNFR before RNTO" );
+  else if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No file name" );
+  else if( makePath( path ))
+  {
+    // f_rename() checks that the destination does not exist
+    //   and that its directory exists
+    DEBUG_PRINT(  "Renaming %s to %s\r\n", cwdRNFR, path );
+    sdlogBegin( cwdRNFR );
+    fr = f_rename( cwdRNFR, path );
+    sdlogEnd( cwdRNFR );
+    ftp_hot_invalidate( cwdRNFR );
+    dircacheInvalidate( cwdRNFR );
+    dircacheInvalidate( path );
+    if( fr == FR_OK )
+      SEND_CONST( "250 File successfully renamed or moved" );
+    else
+      sendFileError( fr, parameters );
+  }
+  return TRUE;
+}
+
+//  SYST
+
+/*
+bool FtpServer::cmdSYST()
+{
+  SEND_CONST( "215 UNIX Type: L8" );
+  return TRUE;
+}
+*/
+
+///////////////////////////////////////
+//                                   //
+//   EXTENSIONS COMMANDS (RFC 3659)  //
+//                                   //
+///////////////////////////////////////
+
+//  FEAT - New Features
+
+bool FtpServer::cmdFEAT()
+{
+  sendBegin( "211-Extensions supported:\r\n") ;
+  sendCat( " MDTM\r\n" );
+  sendCat( " MLSD\r\n" );
+  sendCat( " REST STREAM\r\n" );
+  sendCat( " SIZE\r\n" );
+  sendCat( " SITE FREE\r\n" );
+  sendCatWrite( "211 End." );
+  return TRUE;
+}
+
+//  MDTM - File Modification Time (see RFC 3659)
+
+bool FtpServer::cmdMDTM()
+{
+  char * fname;
+  uint16_t date, time;
+  uint8_t gettime;
+  FRESULT fr;
+
+  gettime = getDateTime( & date, & time );
+  fname = parameters + gettime;
+
+  if( strlen( fname ) == 0 )
+    SEND_CONST( "501 No file name" );
+  else if( makePathFrom( path, fname ))
   {
-    cwdRNFR[ 0 ] = 0;
-    if( strlen( parameters ) == 0 )
-      sendWrite( "501 No file name" );
-    else if( makePath( cwdRNFR ))
+    if( gettime )
     {
-      if( ! fs_exists( cwdRNFR ))
-      {
-        sendBegin( "550 File " );
-        sendCat( parameters );
-        sendCatWrite( " not found" );
-      }
+      // f_utime() walks the path itself
+      finfo.fdate = date;
+      finfo.ftime = time;
+      fr = f_utime( path, & finfo );
+      ftp_hot_invalidate( path );
+      dircacheInvalidate( path );
+      if( fr == FR_OK )
+        SEND_CONST( "200 Ok" );
       else
-      {
-        DEBUG_PRINT( "Renaming %s\r\n", cwdRNFR );
-        sendWrite( "350 RNFR accepted - file exists, ready for destination" );
-      }
+        sendFileError( fr, fname );
+    }
+    else if(( fr = dircacheStat( path, & finfo )) != FR_OK )
+      sendFileError( fr, fname );
+    else
+    {
+      sendBegin( "213 " );
+      sendCatWrite( makeDateTimeStr( finfo.fdate, finfo.ftime ));
     }
   }
-  //
-  //  RNTO - Rename To
-  //
-  else if( ! strcmp( command, "RNTO" ))
-  {
-    char sdir[ FTP_CWD_SIZE ];
-    if( strlen( cwdRNFR ) == 0 )
-      sendWrite( "503 Need RNFR before RNTO" );
-    else if( strlen( parameters ) == 0 )
-      sendWrite( "501 No file name" );
-    else if( makePath( path ))
+  return TRUE;
+}
+
+//  SIZE - Size of the file
+
+bool FtpServer::cmdSIZE()
+{
+  if( strlen( parameters ) == 0 )
+    SEND_CONST( "501 No file name" );
+  else if( makePath( path ))
+  {
+    if( ! fs_exists( path ) || finfo.fattrib & AM_DIR )
+      SEND_CONST( "550 No such file" );
+    else
     {
-      if( fs_exists( path ))
-      {
-        sendBegin( "553 " );
-        sendCat( parameters );
-        sendCatWrite( " already exists" );
-      }
-      else
-      {
-        strcpy( sdir, path );
-        char * psep = strrchr( sdir, '/' );
-        bool fail = psep == NULL;
-        if( ! fail )
-        {
-          if( psep == sdir )
-            psep ++;
-          * psep = 0;
-          fail = ! ( fs_exists( sdir ) &&
-                     ( finfo.fattrib & AM_DIR || ! strcmp( sdir, "/")));
-          if( fail )
-          {
-            sendBegin( "550 \"" );
-            sendCat( sdir );
-            sendCatWrite( "\" is not directory" );
-          }
-          else
-          {
-            DEBUG_PRINT(  "Renaming %s to %s\r\n", cwdRNFR, path );
-            if( f_rename( cwdRNFR, path ) == FR_OK )
-              sendWrite( "250 File successfully renamed or moved" );
-            else
-              fail = true;
-          }
-        }
-        if( fail )
-          sendWrite( "451 Rename/move failure" );
-      }
+      sendBegin( "213 " );
+      sendCatNum( finfo.fsize );
+      sendWrite();
+      f_close( & file );
     }
   }
-  //
-  //  SYST
-  //
-  /*
-  else if( ! strcmp( command, "SYST" ))
+  return TRUE;
+}
+
+// Complete and send the response giving a rate
+
+void FtpServer::sendCatRate( uint16_t kbps )
+{
+  if( kbps == 0 )
+    sendCatWrite( "unlimited" );
+  else
   {
-    sendWrite( "215 UNIX Type: L8" );
+    sendCatNum( kbps );
+    sendCatWrite( " KB/s" );
   }
-  */
+}
 
-  ///////////////////////////////////////
-  //                                   //
-  //   EXTENSIONS COMMANDS (RFC 3659)  //
-  //                                   //
-  ///////////////////////////////////////
+//  SITE - System command
 
+bool FtpServer::cmdSITE()
+{
+  if( ! strcmp( parameters, "FREE" ))
+  {
+    FATFS * fs;
+    uint32_t free_clust;
+    f_getfree( "0:", & free_clust, & fs );
+    sendBegin( "211 " );
+    sendCatNum( free_clust * fs->csize >> 11 );
+    sendCat( " MB free of " );
+    sendCatNum( (fs->n_fatent - 2) * fs->csize >> 11 );
+    sendCatWrite( " MB capacity" );
+  }
   //
-  //  FEAT - New Features
+  //  SITE PREALLOC - size to allocate to each file received by STOR
+  //    when not given by ALLO. 0 disables preallocation
   //
-  else if( ! strcmp( command, "FEAT" ))
+  else if( ! strncmp( parameters, "PREALLOC", 8 ))
   {
-    sendBegin( "211-Extensions supported:\r\n") ;
-    sendCat( " MDTM\r\n" );
-    sendCat( " MLSD\r\n" );
-    sendCat( " SIZE\r\n" );
-    sendCat( " SITE FREE\r\n" );
-    sendCatWrite( "211 End." );
+    allocHint = strtoul( parameters + 8, NULL, 10 );
+    sendBegin( "200 Files will be preallocated with " );
+    sendCatNum( allocHint );
+    sendCatWrite( " bytes" );
   }
   //
-  //  MDTM - File Modification Time (see RFC 3659)
+  //  SITE FASTSEEK - use (1) or not (0) a cluster link map table
+  //    to restart transfers
   //
-  else if( ! strcmp( command, "MDTM" ))
+  else if( ! strncmp( parameters, "FASTSEEK", 8 ))
   {
-    char * fname;
-    uint16_t date, time;
-    uint8_t gettime;
-
-    gettime = getDateTime( & date, & time );
-    fname = parameters + gettime;
-
-    if( strlen( fname ) == 0 )
-      sendWrite( "501 No file name" );
-    else if( makePathFrom( path, fname ))
-    {
-      if( ! fs_exists( path ))
-      {
-        sendBegin( "550 File " );
-        sendCat( fname );
-        sendCatWrite( " not found" );
-      }
-      else if( gettime )
-      {
-        finfo.fdate = date;
-        finfo.ftime = time;
-        if( f_utime( path, & finfo ) == FR_OK )
-          sendWrite( "200 Ok" );
-        else
-          sendWrite( "550 Unable to modify time" );
-      }
-      else
-      {
-        sendBegin( "213 " );
-        sendCatWrite( makeDateTimeStr( finfo.fdate, finfo.ftime ));
-      }
-    }
+    if( strlen( parameters ) > 8 )
+      fastSeek = atoi( parameters + 8 ) != 0;
+    sendBegin( "200 Fast seek is " );
+    sendCatWrite( fastSeek ? "on" : "off" );
   }
   //
-  //  SIZE - Size of the file
+  //  SITE BUFSIZE - size of chunks read or written by RETR and STOR
+  //    0 selects the size of a cluster
   //
-  else if( ! strcmp( command, "SIZE" ))
+  else if( ! strncmp( parameters, "BUFSIZE", 7 ))
   {
-    if( strlen( parameters ) == 0 )
-      sendWrite( "501 No file name" );
-    else if( makePath( path ))
+    uint16_t size = atoi( parameters + 7 );
+    if( size == 0 ||
+        ( size >= 512 && size <= FTP_FILE_BUF_SIZE && size % 512 == 0 ))
+      fileBufSize = size;
+    if( fileBufSize == 0 )
+      SEND_CONST( "200 File buffer size is the cluster size" );
+    else
     {
-      if( ! fs_exists( path ) || finfo.fattrib & AM_DIR )
-        sendWrite( "550 No such file" );
-      else
-      {
-        sendBegin( "213 " );
-        sendCatWrite( i2str( finfo.fsize ));
-        f_close( & file );
-      }
+      sendBegin( "200 File buffer size is " );
+      sendCatNum( fileBufSize );
+      sendWrite();
     }
   }
   //
-  //  SITE - System command
+  //  SITE BUFNBR - number of file buffers used by RETR
+  //    1 disables overlapping of SD card reading and network sending
   //
-  else if( ! strcmp( command, "SITE" ))
+  else if( ! strncmp( parameters, "BUFNBR", 6 ))
   {
-    if( ! strcmp( parameters, "FREE" ))
-    {
-      FATFS * fs;
-      uint32_t free_clust;
-      f_getfree( "0:", & free_clust, & fs );
-      sendBegin( "211 " );
-      sendCat( i2str( free_clust * fs->csize >> 11 ));
-      sendCat( " MB free of " );
-      sendCat( i2str((fs->n_fatent - 2) * fs->csize >> 11 ));
-      sendCatWrite( " MB capacity" );
-    }
-    else
-    {
-      sendBegin( "500 Unknow SITE command " );
-      sendCatWrite( parameters );
-    }
+    uint8_t nbr = atoi( parameters + 6 );
+    if( nbr >= 1 && nbr <= FTP_FILE_BUF_NBR )
+      fileBufNbr = nbr;
+    sendBegin( "200 Number of file buffers is " );
+    sendCatNum( fileBufNbr );
+    sendWrite();
+  }
+  //
+  //  SITE RATE GLOBAL - bandwidth shared by all sessions, in KB/s
+  //    0 is unlimited
+  //
+  else if( ! strncmp( parameters, "RATE GLOBAL", 11 ))
+  {
+    if( strlen( parameters ) > 11 )
+      ftp_rate_set_global( atoi( parameters + 11 ));
+    sendBegin( "200 Global rate is " );
+    sendCatRate( ftp_rate_global );
   }
   //
-  //  STAT - Status command
+  //  SITE RATE - bandwidth of transfers of the session, in KB/s
+  //    0 is unlimited
   //
-  else if( ! strcmp( command, "STAT" ))
-  {
-    uint8_t i, ncli;
-    for( i = 0, ncli = 0; i < FTP_NBR_CLIENTS; i ++ )
-      if( ss[ i ].ftpconn != NULL )
-        ncli ++;
-    sendBegin( "211-FTP server status\r\n" );
-    sendCat( " Local time is " );
-    sendCat( strLocalTime( str ));
-    sendCat( "\r\n " );
-    sendCat( i2str( ncli ));
-    sendCat( " user(s) currently connected to up to " );
-    sendCat( i2str( FTP_NBR_CLIENTS ));
-    sendCat( "\r\n You will be disconnected after " );
-    sendCat( i2str( FTP_TIME_OUT ));
-    sendCat( " minutes of inactivity\r\n" );
-    sendCatWrite( "211 End." );
+  else if( ! strncmp( parameters, "RATE", 4 ))
+  {
+    if( strlen( parameters ) > 4 )
+      rateKB = atoi( parameters + 4 );
+    sendBegin( "200 Session rate is " );
+    sendCatRate( rateKB );
   }
+#if FTP_BENCH
   //
-  //  Unknow command
+  //  SITE BENCH - cost of finding a command
   //
+  else if( ! strcmp( parameters, "BENCH" ))
+    siteBench();
+#endif
   else
-    sendWrite( "500 Unknow command" );
+  {
+    sendBegin( "500 Unknow SITE command " );
+    sendCatWrite( parameters );
+  }
+  return TRUE;
+}
+
+//  STAT - Status command
+
+bool FtpServer::cmdSTAT()
+{
+  sendBegin( "211-FTP server status\r\n" );
+  sendCat( " Local time is " );
+  sendCat( strLocalTime( str ));
+  sendCat( "\r\n " );
+  sendCatNum( ftp_nbr_sessions());
+  sendCat( " user(s) currently connected to up to " );
+  sendCatNum( FTP_NBR_CLIENTS );
+  sendCat( "\r\n You will be disconnected after " );
+  sendCatNum( FTP_TIME_OUT );
+  sendCat( " minutes of inactivity\r\n " );
+  sendCatNum( FTP_NBR_WORKERS );
+  sendCat( " thread(s) of " );
+  sendCatNum( ftp_worker_ram );
+  sendCat( " bytes, RAM per client: " );
+#if FTP_EVENT_ENGINE
+  sendCatNum( sizeof( struct ftp_session ) +
+              ftp_worker_ram * FTP_NBR_WORKERS / FTP_NBR_CLIENTS );
+  sendCat( " bytes (" );
+  sendCatNum( ftp_worker_ram );
+  sendCat( " with one thread per client)" );
+#else
+  sendCatNum( ftp_worker_ram );
+  sendCat( " bytes" );
+#endif
+#if CH_DBG_FILL_THREADS
+  struct stack_stats st;
+  ftp_stack_unused( & st );
+  sendCat( "\r\n Stacks never used: " );
+  sendCatNum( st.server );
+  sendCat( " bytes of ftp_server, " );
+  sendCatNum( st.worker );
+  sendCat( " of ftp_conn, " );
+  sendCatNum( st.storage );
+  sendCat( " of ftp_storage" );
+#endif
+  sendCat( "\r\n " );
+  sendCatNum( ftpas.accepted );
+  sendCat( " clients accepted, " );
+  sendCatNum( ftpas.queued );
+  sendCat( " waited for a free slot, " );
+  sendCatNum( ftpas.refused );
+  sendCat( " refused, " );
+  sendCatNum( ftpas.evicted );
+  sendCat( " idle sessions evicted\r\n Accept latency: 50% <= " );
+  sendCatNum( ftp_accept_percentile( 50 ));
+  sendCat( " ms, 90% <= " );
+  sendCatNum( ftp_accept_percentile( 90 ));
+  sendCat( " ms, 99% <= " );
+  sendCatNum( ftp_accept_percentile( 99 ));
+  sendCat( " ms, max " );
+  sendCatNum( ftpas.maxTime );
+  sendCat( " ms\r\n Passive connections: " );
+  sendCatNum( ftpps.ready );
+  sendCat( " ready before the command, " );
+  sendCatNum( ftpps.waited );
+  sendCat( " waited for " );
+  sendCatNum( ftpps.waited > 0 ? ftpps.timeWait / ftpps.waited : 0 );
+  sendCat( " ms, " );
+  sendCatNum( ftpps.failed );
+  sendCat( " not opened in time, " );
+  sendCatNum( ftpps.stray );
+  sendCat( " stray\r\n Shaping: global rate " );
+  sendCatNum( ftp_rate_global );
+  sendCat( " KB/s (0: unlimited), " );
+  sendCatNum( ftprs.delays );
+  sendCat( " delays for " );
+  sendCatNum( ftprs.timeDelay );
+  sendCat( " ms\r\n Log: " );
+  sendCatNum( sdlogs.records );
+  sendCat( " records, " );
+  sendCatNum( sdlogs.writes );
+  sendCat( " writes, " );
+  sendCatNum( sdlogs.opens );
+  sendCat( " opens, " );
+  sendCatNum( sdlogs.overflows );
+  sendCat( " dropped, " );
+  sendCatNum( sdlogs.busy );
+  sendCat( " dropped for files in use\r\n Storage: " );
+  sendCatNum( ftpss.reads );
+  sendCat( " reads, " );
+  sendCatNum( ftpss.writes );
+  sendCat( " write runs, " );
+  sendCatNum( ftpss.switches );
+  sendCat( " session switches, " );
+  sendCatNum( ftpss.forced );
+  sendCat( " for fairness\r\n" );
+  // Aggregate throughput with 1, 2... transfers running
+  for( uint8_t i = 1; i <= FTP_NBR_WORKERS; i ++ )
+    if( FTP_ST2MS( ftpss.time[ i ] ) > 0 )
+    {
+      sendCat( " Storage: " );
+      sendCatNum( i );
+      sendCat( " transfers, " );
+      sendCatNum( ftpss.bytes[ i ] / 1024 );
+      sendCat( " KB at " );
+      sendCatNum( (uint64_t) ftpss.bytes[ i ] * 1000 / 1024 /
+                  FTP_ST2MS( ftpss.time[ i ] ));
+      sendCat( " KB/s\r\n" );
+    }
+  sendCat( " SD cache: " );
+  sendCatNum( sdcs.hits );
+  sendCat( " hits, " );
+  sendCatNum( sdcs.misses );
+  sendCat( " misses, " );
+  sendCatNum( sdcs.evicts );
+  sendCat( " evictions, " );
+  sendCatNum( sdcs.readAhead );
+  sendCat( " sectors read ahead\r\n SD cache: " );
+  sendCatNum( sdcs.flushed );
+  sendCat( " dirty sectors written with " );
+  sendCatNum( sdcs.flushes );
+  sendCat( " commands, " );
+  sendCatNum( sdcs.bypass );
+  sendCat( " direct transfers\r\n Hot file cache: " );
+  sendCatNum( ftp_hot_hits );
+  sendCat( " hits, " );
+  sendCatNum( ftp_hot_loads );
+  sendCat( " loads of files up to " );
+  sendCatNum( FTP_HOT_FILE_SIZE );
+  sendCat( " bytes\r\n Directory cache: " );
+  sendCatNum( dcs.hits );
+  sendCat( " hits, " );
+  sendCatNum( dcs.misses );
+  sendCat( " misses, " );
+  sendCatNum( dcs.loads );
+  sendCat( " loads, " );
+  sendCatNum( dcs.evicts );
+  sendCat( " evictions, " );
+  sendCatNum( dcs.invalidates );
+  sendCat( " invalidations\r\n" );
+  sendCatWrite( "211 End." );
   return TRUE;
 }
 
@@ -1162,31 +2502,47 @@ bool FtpServer::processCommand( char * command, char * parameters )
 //
 // =========================================================
 
-void FtpServer::service( int8_t n, struct netconn *ctrlcn )
+// Open a session: initialize variables and send the welcome message
+//   nses is the index of the session, identifying its passive data connection
+
+void FtpServer::sessionBegin( uint8_t nses, struct netconn *ctrlcn )
 {
   uint16_t dummy;
-  struct ip_addr ippeer;
-  struct sdlog_stru sdl;
-  systime_t systemTimeBeginConnect;
-  RTCDateTime rtcBeginTime;
 
   //  Led blink fast to show activity
   fast_blink = TRUE;
 
   // variables initialization
-  systemTimeBeginConnect = chVTGetSystemTimeX();
+  timeBeginConnect = chVTGetSystemTimeX();
   rtcGetTime( & RTCD1, & rtcBeginTime );
   strcpy( cwdName, "/" );  // Set the root directory
   cwdRNFR[ 0 ] = 0;
-  num = n;
   ctrlconn = ctrlcn;
-  listdataconn = NULL;
+  sesNum = nses;
   dataconn = NULL;
-  dataPort = FTP_DATA_PORT + num;
+  inbuf = NULL;
+  cmdLen = 0;
+  cmdSkip = false;
+  telnet = TELNET_DATA;
+  bufLen = 0;
+  bufKeep = 0;
+  dataPort = FTP_DATA_PORT;
   cmdStatus = 0;
   dataConnMode = NOTSET;
   finfo.lfname = lfn;
   finfo.lfsize = _MAX_LFN + 1;
+  allocSize = 0;
+  allocHint = 0;
+  restPos = 0;
+  fastSeek = true;
+  fileBufSize = 0;
+  fileBufNbr = FTP_FILE_BUF_NBR;
+  rateKB = 0;
+  for( uint8_t i = 0; i < FTP_FILE_BUF_NBR; i ++ )
+  {
+    fbuf[ i ] = (char *) ftp_file_buf[ num ][ i ];
+    fbufBusy[ i ] = false;
+  }
 
   //  Get the local and peer IP
   netconn_addr( ctrlconn, & ipserver, & dummy );
@@ -1202,64 +2558,91 @@ void FtpServer::service( int8_t n, struct netconn *ctrlcn )
   DEBUG_PRINT( "Client connected!\r\n" );
 
   //  Wait for user name during 10 seconds
-  netconn_set_recvtimeout( ctrlconn, MS2ST( 10 * 1000 ));
-  if( readCommand() < 0 )
-    goto close;
-  if( strcmp( command, "USER" ))
-  {
-    sendWrite( "500 Syntax error" );
-    goto close;
-  }
-  if( strcmp( parameters, FTP_USER ))
-  {
-    sendWrite( "530 " );
-    goto close;
-  }
-  sendWrite( "331 OK. Password required" );
+  login = LOGIN_USER;
+  ctrlTimeOut( 10 );
+}
+
+// Set the delay of inactivity after which the session is closed
+//   With the session engine, ftp_server closes idle sessions, and
+//   workers only wait for the end of a command line
+
+void FtpServer::ctrlTimeOut( uint16_t sec )
+{
+  ctrlTime = sec;
+#if FTP_EVENT_ENGINE
+  netconn_set_recvtimeout( ctrlconn, MS2ST( FTP_EVENT_POLL ));
+#else
+  netconn_set_recvtimeout( ctrlconn, MS2ST( sec * 1000 ));
+#endif
+}
+
+// Process a command line read by readCommand()
+//
+// return false if the session must be closed
 
-  //  Wait for password during 10 seconds
-  if( readCommand() < 0 )
-    goto close;
-  if( strcmp( command, "PASS" ))
+bool FtpServer::processLine()
+{
+  if( login == LOGIN_USER )
   {
-    sendWrite( "500 Syntax error" );
-    goto close;
+    if( strcmp( command, "USER" ))
+    {
+      SEND_CONST( "500 Syntax error" );
+      return false;
+    }
+    if( strcmp( parameters, FTP_USER ))
+    {
+      SEND_CONST( "530 " );
+      return false;
+    }
+    SEND_CONST( "331 OK. Password required" );
+    //  Wait for password during 10 seconds
+    login = LOGIN_PASS;
+    return true;
   }
-  if( strcmp( parameters, FTP_PASS ))
+  if( login == LOGIN_PASS )
   {
-    sendWrite( "530 " );
-    goto close;
+    if( strcmp( command, "PASS" ))
+    {
+      SEND_CONST( "500 Syntax error" );
+      return false;
+    }
+    if( strcmp( parameters, FTP_PASS ))
+    {
+      SEND_CONST( "530 " );
+      return false;
+    }
+    SEND_CONST( "230 OK." );
+    rateKB = ftp_rate_of( FTP_USER, & ippeer );
+    //  Wait for user commands
+    //  Disconnect if FTP_TIME_OUT minutes of inactivity
+    login = LOGIN_DONE;
+    ctrlTimeOut( FTP_TIME_OUT * 60 );
+    return true;
   }
-  sendWrite( "230 OK." );
-
-  //  Wait for user commands
-  //  Disconnect if FTP_TIME_OUT minutes of inactivity
-  netconn_set_recvtimeout( ctrlconn, MS2ST( FTP_TIME_OUT * 60 * 1000 ));
-  while( true )
+  if( ! processCommand( command, parameters ))
   {
-    int8_t err = readCommand();
-    if( err == -4 ) // time out
-      goto close;
-    if( err < 0 )
-      goto close;
-    if( ! processCommand( command, parameters ))
-      goto bye;
+    SEND_CONST( "221 Goodbye" );
+    return false;
   }
+  return true;
+}
+
+// Close the connections of a session and write its log
+//   The control connection is deleted by the caller
 
-  bye:
-  sendWrite( "221 Goodbye" );
+void FtpServer::sessionEnd()
+{
+  struct sdlog_stru sdl;
 
-  close:
   //  Close the connections
+  sendFlush();
   dataClose();
-  if( listdataconn != NULL )
-  {
-    netconn_close( listdataconn );
-    netconn_delete( listdataconn );
-  }
+  ftp_pasv_close( sesNum );
+  if( inbuf != NULL )
+    netbuf_delete( inbuf );
 
   //  Write data to log
-  uint32_t timeConnect = (uint32_t) ( chVTGetSystemTimeX() - systemTimeBeginConnect );
+  uint32_t timeConnect = (uint32_t) ( chVTGetSystemTimeX() - timeBeginConnect );
   strRTCDateTime( str, & rtcBeginTime );
   strcpy( buf, "Connected at " );
   strcat( buf, str );
@@ -1274,7 +2657,124 @@ void FtpServer::service( int8_t n, struct netconn *ctrlcn )
   strcat( str, ".log" );
   sdl.file = str;
   sdl.append = false;
-  chMsgSend( tsdlog, (msg_t) & sdl );
+  sdlogPost( & sdl );
 
   DEBUG_PRINT( "Client disconnected\r\n" );
 }
+
+// One thread per client
+
+void FtpServer::service( int8_t n, struct netconn *ctrlcn )
+{
+  workerInit( n );
+  sessionBegin( n, ctrlcn );
+  while( readCommand() >= 0 && processLine())
+    ;
+  sessionEnd();
+}
+
+// =========================================================
+//
+//                   Session engine
+//
+//  A worker thread restores the state of a session, processes
+//    all the command lines received, and saves the state back
+//    when there are no more bytes to read.
+//
+// =========================================================
+
+bool FtpServer::resume( int8_t n, struct ftp_session * ses )
+{
+  int16_t err;
+
+  workerInit( n );
+  if( ses->login == LOGIN_NEW )
+    sessionBegin( ses->num, ses->ctrlconn );
+  else
+    sessionLoad( ses );
+  if( ses->expired )
+  {
+    if( ses->evicted )
+      SEND_CONST( "421 Idle for too long, closing to serve another client" );
+    sessionEnd();
+    return false;
+  }
+  while(( err = readCommand()) != -4 )
+    if( err < 0 || ! processLine())
+    {
+      sessionEnd();
+      return false;
+    }
+  sendFlush();
+  sessionSave( ses );
+  return true;
+}
+
+void FtpServer::sessionLoad( struct ftp_session * ses )
+{
+  ctrlconn = ses->ctrlconn;
+  login = ses->login;
+  ctrlTime = ses->ctrlTime;
+  inbuf = ses->inbuf;
+  inbufPos = ses->inbufPos;
+  telnet = ses->telnet;
+  cmdLen = ses->cmdLen;
+  memcpy( cmdBuf, ses->cmdBuf, cmdLen );
+  cmdSkip = ses->cmdSkip;
+  sesNum = ses->num;
+  dataconn = NULL;
+  ipclient = ses->ipclient;
+  ipserver = ses->ipserver;
+  ippeer = ses->ippeer;
+  dataPort = ses->dataPort;
+  dataConnMode = ses->dataConnMode;
+  strcpy( cwdName, ses->cwdName );
+  strcpy( cwdRNFR, ses->cwdRNFR );
+  allocSize = ses->allocSize;
+  allocHint = ses->allocHint;
+  restPos = ses->restPos;
+  fastSeek = ses->fastSeek;
+  fileBufSize = ses->fileBufSize;
+  fileBufNbr = ses->fileBufNbr;
+  rateKB = ses->rateKB;
+  timeBeginConnect = ses->timeBeginConnect;
+  rtcBeginTime = ses->rtcBeginTime;
+  bufLen = 0;
+  bufKeep = 0;
+  finfo.lfname = lfn;
+  finfo.lfsize = _MAX_LFN + 1;
+  for( uint8_t i = 0; i < FTP_FILE_BUF_NBR; i ++ )
+  {
+    fbuf[ i ] = (char *) ftp_file_buf[ num ][ i ];
+    fbufBusy[ i ] = false;
+  }
+}
+
+void FtpServer::sessionSave( struct ftp_session * ses )
+{
+  ses->login = login;
+  ses->ctrlTime = ctrlTime;
+  ses->inbuf = inbuf;
+  ses->inbufPos = inbufPos;
+  ses->telnet = telnet;
+  ses->cmdLen = cmdLen;
+  memcpy( ses->cmdBuf, cmdBuf, cmdLen );
+  ses->cmdSkip = cmdSkip;
+  ses->ipclient = ipclient;
+  ses->ipserver = ipserver;
+  ses->ippeer = ippeer;
+  ses->dataPort = dataPort;
+  ses->dataConnMode = dataConnMode;
+  strcpy( ses->cwdName, cwdName );
+  strcpy( ses->cwdRNFR, cwdRNFR );
+  ses->allocSize = allocSize;
+  ses->allocHint = allocHint;
+  ses->restPos = restPos;
+  ses->fastSeek = fastSeek;
+  ses->fileBufSize = fileBufSize;
+  ses->fileBufNbr = fileBufNbr;
+  ses->rateKB = rateKB;
+  ses->timeBeginConnect = timeBeginConnect;
+  ses->rtcBeginTime = rtcBeginTime;
+  ses->timeLast = chVTGetSystemTimeX();
+}
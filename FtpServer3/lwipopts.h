@@ -217,7 +217,8 @@
  * this should be set high.
  */
 #ifndef MEMP_NUM_PBUF
-#define MEMP_NUM_PBUF                   16
+//#define MEMP_NUM_PBUF                   16
+#define MEMP_NUM_PBUF                   32  // file buffers are sent by reference
 #endif
 
 /**
@@ -243,7 +244,10 @@
  */
 #ifndef MEMP_NUM_TCP_PCB
 //#define MEMP_NUM_TCP_PCB                5
-#define MEMP_NUM_TCP_PCB                10
+//#define MEMP_NUM_TCP_PCB                10
+//#define MEMP_NUM_TCP_PCB                32  // FTP_NBR_CLIENTS + FTP_NBR_WORKERS + closing ones
+//#define MEMP_NUM_TCP_PCB                48  // 20 clients: FTP_NBR_TCP_PCB (see ftps.h) + 2 closing ones
+#define MEMP_NUM_TCP_PCB                18  // FTP_NBR_TCP_PCB (see ftps.h) + 2 closing ones
 #endif
 
 /**
@@ -251,7 +255,7 @@
  * (requires the LWIP_TCP option)
  */
 #ifndef MEMP_NUM_TCP_PCB_LISTEN
-#define MEMP_NUM_TCP_PCB_LISTEN         8
+#define MEMP_NUM_TCP_PCB_LISTEN         8   // >= FTP_NBR_TCP_PCB_LISTEN (see ftps.h)
 #endif
 
 /**
@@ -259,7 +263,8 @@
  * (requires the LWIP_TCP option)
  */
 #ifndef MEMP_NUM_TCP_SEG
-#define MEMP_NUM_TCP_SEG                16
+//#define MEMP_NUM_TCP_SEG                16
+#define MEMP_NUM_TCP_SEG                32
 #endif
 
 /**
@@ -318,7 +323,9 @@
 #ifndef MEMP_NUM_NETBUF
 //#define MEMP_NUM_NETBUF                 2
 //#define MEMP_NUM_NETBUF                 5
-#define MEMP_NUM_NETBUF                 6  // one for NTP
+//#define MEMP_NUM_NETBUF                 6  // one for NTP
+//#define MEMP_NUM_NETBUF                 21  // 20 clients: FTP_NBR_CLIENTS + 1, one for NTP
+#define MEMP_NUM_NETBUF                 6   // FTP_NBR_CLIENTS + 1, one for NTP
 #endif
 
 /**
@@ -328,7 +335,11 @@
 #ifndef MEMP_NUM_NETCONN
 //#define MEMP_NUM_NETCONN                4
 //#define MEMP_NUM_NETCONN                16
-#define MEMP_NUM_NETCONN                17  // one for NTP
+//#define MEMP_NUM_NETCONN                17  // one for NTP
+//#define MEMP_NUM_NETCONN                48  // 2 * FTP_NBR_CLIENTS + FTP_NBR_WORKERS + 1, one for NTP
+//#define MEMP_NUM_NETCONN                32  // FTP_NBR_CLIENTS + FTP_NBR_WORKERS + FTP_PASV_LISTENERS + 2, one for NTP
+//#define MEMP_NUM_NETCONN                52  // 20 clients: FTP_NBR_NETCONN (see ftps.h), one for NTP
+#define MEMP_NUM_NETCONN                22  // FTP_NBR_NETCONN (see ftps.h), one for NTP
 #endif
 
 /**
@@ -408,6 +419,8 @@
 
 /**
  * PBUF_POOL_SIZE: the number of buffers in the pbuf pool. 
+ * Must be at least FTP_STOR_QUEUE_MAX + FTP_NBR_WORKERS + FTP_PBUF_SPARE
+ * (see ftps.h)
  */
 #ifndef PBUF_POOL_SIZE
 #define PBUF_POOL_SIZE                  16
@@ -976,7 +989,8 @@
  * To achieve good performance, this should be at least 2 * TCP_MSS.
  */
 #ifndef TCP_SND_BUF
-#define TCP_SND_BUF                     (2 * TCP_MSS)
+//#define TCP_SND_BUF                     (2 * TCP_MSS)
+#define TCP_SND_BUF                     (4 * TCP_MSS)
 #endif
 
 /**
@@ -32,6 +32,8 @@
 #include <ftps/ftps.h>
 #include <ntpc/ntpc.h>
 #include <sdlog/sdlog.h>
+#include <sdcache/sdcache.h>
+#include <dircache/dircache.h>
 
 //==========================================================================*/
 // Green LED blinker thread
@@ -124,6 +126,8 @@ int main( void )
   sdStart( & SD6, NULL );
   sdcStart( & SDCD1, NULL );
   sdcConnect( & SDCD1 );
+  sdcacheInit();
+  dircacheInit();
   f_mount( & SDC_FS, "/", 1 );
 
   // Creates the blinker thread.
@@ -131,6 +135,7 @@ int main( void )
                      NORMALPRIO, Thread1, NULL );
 
   // Creates the Logger thread
+  sdlogInit();
   tsdlog = chThdCreateStatic( wa_sd_logger, sizeof( wa_sd_logger ),
                               SDLOG_SERVER_THREAD_PRIORITY, sd_logger, NULL );
 
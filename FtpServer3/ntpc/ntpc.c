@@ -401,7 +401,7 @@ THD_FUNCTION( ntp_scheduler, p )
       strcat( line, " SrvIP: " );
       strcat( line, ipaddr_ntoa( & ntps.addr ));
       strcat( line, "\r\n" );
-      chMsgSend( tsdlog, (msg_t) & sdl );
+      sdlogPost( & sdl );
 
       //printRtcStat();
 
@@ -0,0 +1,377 @@
+/*
+ *
+ *  SD sector cache on STM32-E407 with ChibiOs
+ *
+ *  Copyright (c) 2015 by Jean-Michel Gallego
+ *
+ *  Please read file ReadMe.txt for instructions
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+// Disk I/O functions of FatFs for the SD card, with a cache of sectors
+//   shared by all files and threads.
+// Replace fatfs_diskio.c of ChibiOs (see Makefile)
+//
+// FatFs accesses FAT and directory sectors one at a time. Those sectors are
+//   kept in a LRU cache. Data of files, read or written by several sectors,
+//   go directly between the card and the buffer of the caller.
+// With _FS_REENTRANT, FatFs calls those functions with the volume locked,
+//   so the cache needs no other protection.
+
+#include "sdcache.h"
+
+#include "diskio.h"
+#include "string.h"
+
+#define SDCACHE_VALID            0x01
+#define SDCACHE_DIRTY            0x02
+
+struct sdcache_block
+{
+  DWORD    sector;
+  uint32_t used;                  // value of useCounter when last used
+  uint8_t  flags;
+};
+
+static struct sdcache_block sdcb[ SDCACHE_BLOCKS ] SDCACHE_SECTION;
+static uint8_t sdcdata[ SDCACHE_BLOCKS ][ MMCSD_BLOCK_SIZE ] SDCACHE_SECTION;
+
+// Sector number of a block reserved by fill(), not read yet
+#define SDCACHE_NO_SECTOR        0xFFFFFFFF
+
+// Buffer for DMA transfers between the card and the cache
+static uint32_t bounce[ SDCACHE_READ_AHEAD * MMCSD_BLOCK_SIZE / 4 ];
+
+static uint32_t useCounter;
+static DWORD    nextSeqSector;    // sector following last read ahead
+
+struct sdcache_stru sdcs;
+
+// =========================================================
+//
+//                   Cache management
+//
+// =========================================================
+
+// Must be called before mounting the volume
+//   (section .ram4 is not initialized at startup)
+
+void sdcacheInit( void )
+{
+  uint8_t i;
+
+  for( i = 0; i < SDCACHE_BLOCKS; i ++ )
+    sdcb[ i ].flags = 0;
+  useCounter = 0;
+  nextSeqSector = 0xFFFFFFFF;
+  memset( & sdcs, 0, sizeof( sdcs ));
+}
+
+static DRESULT cardRead( uint8_t * buff, DWORD sector, UINT count )
+{
+  if( sdcRead( & SDCD1, sector, buff, count ))
+    return RES_ERROR;
+  return RES_OK;
+}
+
+static DRESULT cardWrite( const uint8_t * buff, DWORD sector, UINT count )
+{
+  if( sdcWrite( & SDCD1, sector, buff, count ))
+    return RES_ERROR;
+  return RES_OK;
+}
+
+// Return index of block caching sector, or -1
+
+static int8_t lookup( DWORD sector )
+{
+  int8_t i;
+
+  for( i = 0; i < SDCACHE_BLOCKS; i ++ )
+    if(( sdcb[ i ].flags & SDCACHE_VALID ) && sdcb[ i ].sector == sector )
+      return i;
+  return -1;
+}
+
+static bool isDirty( DWORD sector )
+{
+  int8_t i = lookup( sector );
+
+  return i >= 0 && ( sdcb[ i ].flags & SDCACHE_DIRTY );
+}
+
+// Write the dirty sector of block i to the card, together with the dirty
+//   sectors around it, with one multiple block command
+
+static DRESULT flushRun( int8_t i )
+{
+  DWORD first = sdcb[ i ].sector;
+  UINT  n = 0;
+  int8_t j;
+
+  while( first > 0 && sdcb[ i ].sector - first < SDCACHE_READ_AHEAD - 1 &&
+         isDirty( first - 1 ))
+    first --;
+  while( n < SDCACHE_READ_AHEAD && isDirty( first + n ))
+  {
+    memcpy( (uint8_t *) bounce + n * MMCSD_BLOCK_SIZE,
+            sdcdata[ lookup( first + n ) ], MMCSD_BLOCK_SIZE );
+    n ++;
+  }
+  if( cardWrite( (uint8_t *) bounce, first, n ) != RES_OK )
+    return RES_ERROR;
+  sdcs.flushes ++;
+  sdcs.flushed += n;
+  while( n -- > 0 )
+  {
+    j = lookup( first + n );
+    sdcb[ j ].flags &= ~SDCACHE_DIRTY;
+  }
+  return RES_OK;
+}
+
+// Write to the card all dirty sectors from sector to sector + count - 1
+//   (all dirty sectors if count is 0)
+
+static DRESULT flushRange( DWORD sector, UINT count )
+{
+  int8_t i;
+
+  for( i = 0; i < SDCACHE_BLOCKS; i ++ )
+    if(( sdcb[ i ].flags & SDCACHE_DIRTY ) &&
+       ( count == 0 ||
+         ( sdcb[ i ].sector >= sector && sdcb[ i ].sector - sector < count )))
+      if( flushRun( i ) != RES_OK )
+        return RES_ERROR;
+  return RES_OK;
+}
+
+// Forget cached copies of sectors overwritten by a direct write
+
+static void invalidateRange( DWORD sector, UINT count )
+{
+  int8_t i;
+
+  for( i = 0; i < SDCACHE_BLOCKS; i ++ )
+    if(( sdcb[ i ].flags & SDCACHE_VALID ) &&
+       sdcb[ i ].sector >= sector && sdcb[ i ].sector - sector < count )
+      sdcb[ i ].flags = 0;
+}
+
+// Return index of a block free to receive a new sector, or -1 on error
+//   The least recently used block is evicted, after writing it if dirty
+
+static int8_t victim( void )
+{
+  int8_t i, lru = 0;
+
+  for( i = 0; i < SDCACHE_BLOCKS; i ++ )
+  {
+    if( ! ( sdcb[ i ].flags & SDCACHE_VALID ))
+      return i;
+    if( sdcb[ i ].used < sdcb[ lru ].used )
+      lru = i;
+  }
+  if(( sdcb[ lru ].flags & SDCACHE_DIRTY ) && flushRun( lru ) != RES_OK )
+    return -1;
+  sdcb[ lru ].flags = 0;
+  sdcs.evicts ++;
+  return lru;
+}
+
+// Read sector from the card into the cache
+//   If it follows the previous miss, next sectors are read too
+//   Blocks are reserved before reading, because evicting a dirty block
+//   writes it through the bounce buffer
+//
+// Return index of the block, or -1 on error
+
+static int8_t fill( DWORD sector )
+{
+  UINT   n = 1;
+  UINT   k;
+  int8_t i, blk[ SDCACHE_READ_AHEAD ];
+
+  if( sector == nextSeqSector )
+    n = SDCACHE_READ_AHEAD;
+  if( sector + n > mmcsdGetCardCapacity( & SDCD1 ))
+    n = 1;
+  for( k = 0; k < n; k ++ )
+  {
+    // Keep sectors already in cache: they can be dirty
+    blk[ k ] = -1;
+    if( k > 0 && lookup( sector + k ) >= 0 )
+      continue;
+    i = victim();
+    if( i < 0 )
+      break;
+    // Most recently used, so that victim() does not take it again
+    sdcb[ i ].sector = SDCACHE_NO_SECTOR;
+    sdcb[ i ].flags = SDCACHE_VALID;
+    sdcb[ i ].used = ++ useCounter;
+    blk[ k ] = i;
+  }
+  if( k < n || cardRead( (uint8_t *) bounce, sector, n ) != RES_OK )
+  {
+    while( k -- > 0 )
+      if( blk[ k ] >= 0 )
+        sdcb[ blk[ k ]].flags = 0;
+    return -1;
+  }
+  nextSeqSector = sector + n;
+  for( k = 0; k < n; k ++ )
+  {
+    if(( i = blk[ k ]) < 0 )
+      continue;
+    memcpy( sdcdata[ i ], (uint8_t *) bounce + k * MMCSD_BLOCK_SIZE,
+            MMCSD_BLOCK_SIZE );
+    sdcb[ i ].sector = sector + k;
+    if( k > 0 )
+      sdcs.readAhead ++;
+  }
+  return blk[ 0 ];
+}
+
+// =========================================================
+//
+//                   Disk I/O functions
+//
+// =========================================================
+
+DSTATUS disk_initialize( BYTE pdrv )
+{
+  DSTATUS stat = 0;
+
+  if( pdrv != 0 )
+    return STA_NOINIT;
+  // It is initialized externally, just reads the status
+  if( blkGetDriverState( & SDCD1 ) != BLK_READY )
+    stat |= STA_NOINIT;
+  return stat;
+}
+
+DSTATUS disk_status( BYTE pdrv )
+{
+  DSTATUS stat = 0;
+
+  if( pdrv != 0 )
+    return STA_NOINIT;
+  if( blkGetDriverState( & SDCD1 ) != BLK_READY )
+    stat |= STA_NOINIT;
+  if( sdcIsWriteProtected( & SDCD1 ))
+    stat |= STA_PROTECT;
+  return stat;
+}
+
+DRESULT disk_read( BYTE pdrv, BYTE * buff, DWORD sector, UINT count )
+{
+  int8_t i;
+
+  if( pdrv != 0 )
+    return RES_PARERR;
+  if( blkGetDriverState( & SDCD1 ) != BLK_READY )
+    return RES_NOTRDY;
+  if( count > SDCACHE_MAX_COUNT )
+  {
+    sdcs.bypass ++;
+    if( flushRange( sector, count ) != RES_OK )
+      return RES_ERROR;
+    return cardRead( buff, sector, count );
+  }
+  for( ; count > 0; count --, sector ++, buff += MMCSD_BLOCK_SIZE )
+  {
+    i = lookup( sector );
+    if( i >= 0 )
+      sdcs.hits ++;
+    else
+    {
+      sdcs.misses ++;
+      i = fill( sector );
+      if( i < 0 )
+        return RES_ERROR;
+    }
+    memcpy( buff, sdcdata[ i ], MMCSD_BLOCK_SIZE );
+    sdcb[ i ].used = ++ useCounter;
+  }
+  return RES_OK;
+}
+
+DRESULT disk_write( BYTE pdrv, const BYTE * buff, DWORD sector, UINT count )
+{
+  int8_t i;
+
+  if( pdrv != 0 )
+    return RES_PARERR;
+  if( blkGetDriverState( & SDCD1 ) != BLK_READY )
+    return RES_NOTRDY;
+  if( sdcIsWriteProtected( & SDCD1 ))
+    return RES_WRPRT;
+  if( count > SDCACHE_MAX_COUNT )
+  {
+    sdcs.bypass ++;
+    invalidateRange( sector, count );
+    return cardWrite( buff, sector, count );
+  }
+  for( ; count > 0; count --, sector ++, buff += MMCSD_BLOCK_SIZE )
+  {
+    i = lookup( sector );
+    if( i < 0 )
+    {
+      i = victim();
+      if( i < 0 )
+        return RES_ERROR;
+      sdcb[ i ].sector = sector;
+    }
+    memcpy( sdcdata[ i ], buff, MMCSD_BLOCK_SIZE );
+    sdcb[ i ].flags = SDCACHE_VALID | SDCACHE_DIRTY;
+    sdcb[ i ].used = ++ useCounter;
+#if ! SDCACHE_WRITE_BACK
+    if( flushRun( i ) != RES_OK )
+      return RES_ERROR;
+#endif
+  }
+  return RES_OK;
+}
+
+DRESULT disk_ioctl( BYTE pdrv, BYTE cmd, void * buff )
+{
+  if( pdrv != 0 )
+    return RES_PARERR;
+  switch( cmd )
+  {
+    case CTRL_SYNC:
+      // Called by FatFs when a file is closed or synced
+      return flushRange( 0, 0 );
+    case GET_SECTOR_COUNT:
+      * ((DWORD *) buff ) = mmcsdGetCardCapacity( & SDCD1 );
+      return RES_OK;
+    case GET_SECTOR_SIZE:
+      * ((WORD *) buff ) = MMCSD_BLOCK_SIZE;
+      return RES_OK;
+    case GET_BLOCK_SIZE:
+      * ((DWORD *) buff ) = 256;  // 128KB blocks, should be read from the card
+      return RES_OK;
+    default:
+      return RES_PARERR;
+  }
+}
+
+DWORD get_fattime( void )
+{
+  RTCDateTime timespec;
+
+  rtcGetTime( & RTCD1, & timespec );
+  return rtcConvertDateTimeToFAT( & timespec );
+}
@@ -0,0 +1,75 @@
+/*
+ *
+ *  SD sector cache on STM32-E407 with ChibiOs
+ *
+ *  Copyright (c) 2015 by Jean-Michel Gallego
+ *
+ *  Please read file ReadMe.txt for instructions
+ *
+ *  This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef _SDCACHE_H_
+#define _SDCACHE_H_
+
+#include "ch.h"
+#include "hal.h"
+
+#include "ff.h"
+
+#include "console.h"
+
+// Number of sectors kept in cache
+#define SDCACHE_BLOCKS           16
+
+// Requests of more sectors than this go directly between the card and
+//   the buffer of FatFs. They are reads and writes of file data.
+#define SDCACHE_MAX_COUNT        1
+
+// Number of sectors read at once when a miss follows the previous one
+//   Also maximum number of dirty sectors written with one command
+//   Must be less than SDCACHE_BLOCKS
+#define SDCACHE_READ_AHEAD       4
+
+// 1 to keep written sectors in cache until FatFs syncs the volume
+// 0 to write them immediately to the card
+#define SDCACHE_WRITE_BACK       1
+
+// Section where cached sectors are stored. The CCM RAM can't be reached
+//   by DMA, so transfers with the card go through a buffer in main RAM
+#define SDCACHE_SECTION          __attribute__(( section( ".ram4" )))
+
+// Statistics of the cache
+struct sdcache_stru
+{
+  uint32_t hits;                  // sectors found in cache
+  uint32_t misses;                // sectors read from the card
+  uint32_t evicts;                // sectors removed to make room
+  uint32_t readAhead;             // sectors read before being requested
+  uint32_t flushes;               // write commands of dirty sectors
+  uint32_t flushed;               // dirty sectors written
+  uint32_t bypass;                // requests not going through the cache
+};
+
+extern struct sdcache_stru sdcs;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+  void sdcacheInit( void );
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _SDCACHE_H_
@@ -21,45 +21,299 @@
  */
 
 #include "sdlog.h"
+#include <dircache/dircache.h>
 
 #include "string.h"
+#include <strings.h>
 
 //  Stack area for the SdLog Server thread.
 THD_WORKING_AREA( wa_sd_logger, SDLOG_SERVER_THREAD_STACK_SIZE );
 
 thread_t * tsdlog;
 
+struct sdlog_stats sdlogs;
+
+// Record copied from the message of a producer
+struct sdlog_rec
+{
+  char file[ SDLOG_FILE_SIZE ];
+  char line[ SDLOG_LINE_SIZE ];
+  bool append;
+};
+
+// Records are taken from a pool by the producers, and given back
+//   by sd_logger once gathered
+static struct sdlog_rec sdlog_recs[ SDLOG_RECORDS ];
+static memory_pool_t sdlog_pool;
+static msg_t sdlog_msg[ SDLOG_RECORDS ];
+static mailbox_t sdlog_mb;
+
+// Log file kept open, and lines gathered for it
+struct sdlog_file
+{
+  char     file[ SDLOG_FILE_SIZE ];   // empty if unused
+  FIL      fil;
+  bool     open;                      // fil is open
+  bool     create;                    // file must be truncated first
+  uint16_t len;
+  systime_t tFirst;                   // time the first line was gathered
+  systime_t tUsed;                    // time of last line or write
+  char     buf[ SDLOG_FLUSH_SIZE ];
+};
+
+// Files are used by sd_logger, and closed by sdlogBegin() before
+//   an FTP session modifies them
+static struct sdlog_file sdlog_files[ SDLOG_FILES ];
+static mutex_t sdlog_mtx;
+
+// Files modified by FTP sessions, from sdlogBegin() to sdlogEnd()
+//   sdlog_busy_sem counts the free entries
+static char sdlog_busy[ SDLOG_BUSY ][ SDLOG_FILE_SIZE ];
+static semaphore_t sdlog_busy_sem;
+
+// =========================================================
+//
+//                   Producers
+//
+// =========================================================
+
+void sdlogInit( void )
+{
+  chPoolObjectInit( & sdlog_pool, sizeof( struct sdlog_rec ), NULL );
+  chPoolLoadArray( & sdlog_pool, sdlog_recs, SDLOG_RECORDS );
+  chMBObjectInit( & sdlog_mb, sdlog_msg, SDLOG_RECORDS );
+  chMtxObjectInit( & sdlog_mtx );
+  chSemObjectInit( & sdlog_busy_sem, SDLOG_BUSY );
+}
+
+// Queue a line to be written to a log file
+//   The line and the file name are copied, so the caller does not wait
+//   for the SD card
+//
+// return false if the line is dropped
+
+bool sdlogPost( struct sdlog_stru * plog )
+{
+  struct sdlog_rec * prec;
+
+  prec = (struct sdlog_rec *) chPoolAlloc( & sdlog_pool );
+  if( prec == NULL )
+  {
+    chSysLock();
+    sdlogs.overflows ++;
+    chSysUnlock();
+    return false;
+  }
+  strncpy( prec->file, plog->file, SDLOG_FILE_SIZE - 1 );
+  prec->file[ SDLOG_FILE_SIZE - 1 ] = 0;
+  strncpy( prec->line, plog->line, SDLOG_LINE_SIZE - 1 );
+  prec->line[ SDLOG_LINE_SIZE - 1 ] = 0;
+  prec->append = plog->append;
+  // Never blocks: the mailbox has a slot for each record of the pool
+  chMBPost( & sdlog_mb, (msg_t) prec, TIME_IMMEDIATE );
+  chSysLock();
+  sdlogs.records ++;
+  chSysUnlock();
+  return true;
+}
+
 // =========================================================
 //
 //                   SD Logger thread
 //
 // =========================================================
 
-THD_FUNCTION( sd_logger, p )
+// Write the lines gathered for a file, opening it if needed
+//   f_sync() updates the directory entry, so the file stays consistent
+//   while it is open
+
+static void sdlogWrite( struct sdlog_file * pf )
 {
-  (void) p;
-  struct sdlog_stru * plog;
-  FIL    file;
   UINT   nb;
   BYTE   mode;
 
-  chRegSetThreadName( "sd_logger" );
+  DEBUG_PRINT( "Write to file %s %u bytes\r\n", pf->file, pf->len );
+  if( ! pf->open )
+  {
+    mode = FA_WRITE | ( pf->create ? FA_CREATE_ALWAYS : FA_OPEN_ALWAYS );
+    pf->open = f_open( & pf->fil, pf->file, mode ) == FR_OK;
+    if( pf->open && ! pf->create )
+      f_lseek( & pf->fil, f_size( & pf->fil ));
+    sdlogs.opens ++;
+  }
+  else if( pf->create )
+  {
+    f_lseek( & pf->fil, 0 );
+    f_truncate( & pf->fil );
+  }
+  if( pf->open )
+  {
+    f_write( & pf->fil, pf->buf, pf->len, (UINT *) & nb );
+    f_sync( & pf->fil );
+    dircacheInvalidate( pf->file );
+    sdlogs.writes ++;
+  }
+  else
+    pf->file[ 0 ] = 0;
+  pf->create = false;
+  pf->len = 0;
+  pf->tUsed = chVTGetSystemTimeX();
+}
 
-  while( true )
+// Write the lines gathered for a file and close it
+
+static void sdlogRelease( struct sdlog_file * pf )
+{
+  if( pf->len > 0 )
+    sdlogWrite( pf );
+  if( pf->open )
+    f_close( & pf->fil );
+  pf->open = false;
+  pf->file[ 0 ] = 0;
+}
+
+// Names of FAT files are not case sensitive
+
+static bool sdlogIsBusy( const char * file )
+{
+  for( uint8_t i = 0; i < SDLOG_BUSY; i ++ )
+    if( ! strcasecmp( sdlog_busy[ i ], file ))
+      return true;
+  return false;
+}
+
+// Add a record to the lines gathered for its file
+//   Records of a file modified by an FTP session are dropped
+
+static void sdlogGather( struct sdlog_rec * prec )
+{
+  struct sdlog_file * pf = NULL;
+  uint16_t len = strlen( prec->line );
+  systime_t now = chVTGetSystemTimeX();
+  uint8_t  i;
+
+  if( sdlogIsBusy( prec->file ))
   {
-    thread_t * tp = chMsgWait();
-    plog = (struct sdlog_stru *) chMsgGet( tp );
-    DEBUG_PRINT( "Write to file %s\r\n%s\r\n", plog->file, plog->line );
+    sdlogs.busy ++;
+    return;
+  }
+  for( i = 0; i < SDLOG_FILES; i ++ )
+    if( ! strcasecmp( sdlog_files[ i ].file, prec->file ))
+    {
+      pf = & sdlog_files[ i ];
+      break;
+    }
+  // Lines gathered before would be lost when creating the file
+  if( pf != NULL && ! prec->append )
+    pf->len = 0;
+  if( pf == NULL )
+  {
+    // Take a free slot, or close the least recently used file
+    pf = & sdlog_files[ 0 ];
+    for( i = 0; i < SDLOG_FILES && sdlog_files[ i ].file[ 0 ] != 0; i ++ )
+      if( now - sdlog_files[ i ].tUsed > now - pf->tUsed )
+        pf = & sdlog_files[ i ];
+    if( i < SDLOG_FILES )
+      pf = & sdlog_files[ i ];
+    else
+      sdlogRelease( pf );
+    strcpy( pf->file, prec->file );
+    pf->create = false;
+    pf->len = 0;
+  }
+  if( pf->len == 0 )
+    pf->tFirst = now;
+  pf->tUsed = now;
+  if( ! prec->append )
+    pf->create = true;
+  memcpy( pf->buf + pf->len, prec->line, len );
+  pf->len += len;
+  // Write before the next line may not fit
+  if( pf->len + SDLOG_LINE_SIZE > SDLOG_FLUSH_SIZE )
+    sdlogWrite( pf );
+}
+
+// Close a log file, if open, before an FTP session modifies it, and
+//   keep sd_logger from opening it again until sdlogEnd()
+//   Longer names than SDLOG_FILE_SIZE are not the ones of log files
 
-    mode = FA_WRITE | ( plog->append ? FA_OPEN_ALWAYS : FA_CREATE_ALWAYS );
-    if( f_open( & file, plog->file, mode ) == FR_OK )
+void sdlogBegin( const char * path )
+{
+  uint8_t i;
+
+  if( strlen( path ) >= SDLOG_FILE_SIZE )
+    return;
+  chSemWait( & sdlog_busy_sem );
+  chMtxLock( & sdlog_mtx );
+  for( i = 0; sdlog_busy[ i ][ 0 ] != 0; i ++ )
+    ;
+  strcpy( sdlog_busy[ i ], path );
+  for( i = 0; i < SDLOG_FILES; i ++ )
+    if( sdlog_files[ i ].file[ 0 ] != 0 &&
+        ! strcasecmp( sdlog_files[ i ].file, path ))
+      sdlogRelease( & sdlog_files[ i ] );
+  chMtxUnlock( & sdlog_mtx );
+}
+
+// The FTP session is done with the file given to sdlogBegin()
+
+void sdlogEnd( const char * path )
+{
+  if( strlen( path ) >= SDLOG_FILE_SIZE )
+    return;
+  chMtxLock( & sdlog_mtx );
+  for( uint8_t i = 0; i < SDLOG_BUSY; i ++ )
+    if( ! strcasecmp( sdlog_busy[ i ], path ))
     {
-      if( plog->append )
-        f_lseek( & file, f_size( & file ));
-      f_write( & file, plog->line, strlen( plog->line ), (UINT *) & nb );
-      f_close( & file );
+      sdlog_busy[ i ][ 0 ] = 0;
+      chSemSignal( & sdlog_busy_sem );
+      break;
     }
+  chMtxUnlock( & sdlog_mtx );
+}
 
-    chMsgRelease( tp, MSG_OK );
+THD_FUNCTION( sd_logger, p )
+{
+  (void) p;
+  msg_t     msg;
+  systime_t timeout, wait, now;
+  uint8_t   i;
+
+  chRegSetThreadName( "sd_logger" );
+
+  while( true )
+  {
+    // Write the lines gathered for SDLOG_FLUSH_TIME ms, close the files
+    //   idle for SDLOG_IDLE_CLOSE seconds, and sleep until the next of
+    //   these deadlines or a record arrives
+    timeout = TIME_INFINITE;
+    chMtxLock( & sdlog_mtx );
+    for( i = 0; i < SDLOG_FILES; i ++ )
+    {
+      struct sdlog_file * pf = & sdlog_files[ i ];
+      if( pf->file[ 0 ] == 0 )
+        continue;
+      now = chVTGetSystemTimeX();
+      if( pf->len > 0 && now - pf->tFirst >= MS2ST( SDLOG_FLUSH_TIME ))
+        sdlogWrite( pf );
+      else if( pf->len == 0 && now - pf->tUsed >= S2ST( SDLOG_IDLE_CLOSE ))
+        sdlogRelease( pf );
+      if( pf->file[ 0 ] == 0 )
+        continue;
+      now = chVTGetSystemTimeX();
+      if( pf->len > 0 )
+        wait = MS2ST( SDLOG_FLUSH_TIME ) - ( now - pf->tFirst );
+      else
+        wait = S2ST( SDLOG_IDLE_CLOSE ) - ( now - pf->tUsed );
+      if( wait < timeout )
+        timeout = wait;
+    }
+    chMtxUnlock( & sdlog_mtx );
+    if( chMBFetch( & sdlog_mb, & msg, timeout ) != MSG_OK )
+      continue;
+    chMtxLock( & sdlog_mtx );
+    sdlogGather( (struct sdlog_rec *) msg );
+    chMtxUnlock( & sdlog_mtx );
+    chPoolFree( & sdlog_pool, (void *) msg );
   }
 }
@@ -33,6 +33,28 @@
 
 #define SDLOG_SERVER_THREAD_PRIORITY   (LOWPRIO + 1)
 
+// Number of records waiting for sd_logger. When all are used, records
+//   are dropped and counted in sdlogs.overflows
+#define SDLOG_RECORDS            8
+// Maximum length of the name of a log file and of a line
+#define SDLOG_FILE_SIZE          32
+#define SDLOG_LINE_SIZE          96
+
+// Lines of a file are gathered and written at once when SDLOG_FLUSH_SIZE
+//   bytes are reached, or SDLOG_FLUSH_TIME ms after the first of them.
+#define SDLOG_FILES              4
+#define SDLOG_FLUSH_SIZE         512
+#define SDLOG_FLUSH_TIME         2000          // in milliseconds
+
+// Files are kept open, up to SDLOG_FILES, the least recently used being
+//   closed first. A file without lines for SDLOG_IDLE_CLOSE seconds is
+//   closed
+#define SDLOG_IDLE_CLOSE         30            // in seconds
+
+// Number of files FTP sessions can modify at once. Lines for these
+//   files are dropped until the sessions are done (see sdlogBegin())
+#define SDLOG_BUSY               4
+
 extern THD_WORKING_AREA( wa_sd_logger, SDLOG_SERVER_THREAD_STACK_SIZE );
 extern thread_t * tsdlog;
 
@@ -44,9 +66,25 @@ struct sdlog_stru
   bool append;
 };
 
+// Statistics of sd_logger
+struct sdlog_stats
+{
+  uint32_t records;               // records queued
+  uint32_t overflows;             // records dropped, no record was free
+  uint32_t writes;                // writes to files, each one synced
+  uint32_t opens;                 // files opened
+  uint32_t busy;                  // records dropped, their file was modified
+};
+
+extern struct sdlog_stats sdlogs;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
+  void sdlogInit( void );
+  bool sdlogPost( struct sdlog_stru * plog );
+  void sdlogBegin( const char * path );
+  void sdlogEnd( const char * path );
   THD_FUNCTION( sd_logger, p );
 #ifdef __cplusplus
 }